@@ -0,0 +1,50 @@
+# Times the first render of a chart in a process forked from a master,
+# as in a preforking server, with and without Rplot.warmup in the
+# master. Each sample runs in a fresh Ruby process.
+#
+#    ruby bench/warmup.rb [type] [runs]
+#
+# or <tt>rake bench:warmup TYPE=png RUNS=10</tt>.
+
+require 'rbconfig'
+
+type = ARGV[0] || 'png'
+runs = (ARGV[1] || 10).to_i
+lib = File.expand_path('../../lib', __FILE__)
+
+sample = <<-RUBY
+  require 'rplot'
+  Rplot.warmup(:types => [#{type.dump}], :fonts => ['HersheySerif']) if ARGV[0] == 'warm'
+  reader, writer = IO.pipe
+  pid = fork do
+    reader.close
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    Plotter.draw(#{type.dump}, File::NULL) do |p|
+      p.space(0, 0, 100, 100)
+      p.pencolor('blue')
+      p.box(10, 10, 90, 90)
+      p.circle(50, 50, 30)
+      p.fontname('HersheySerif')
+      p.move(50, 50)
+      p.alabel('c', 'c', 'First render')
+    end
+    writer.puts(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started)
+    writer.close
+    exit!(0)
+  end
+  writer.close
+  print reader.read
+  Process.wait(pid)
+RUBY
+
+median = lambda do |mode|
+  times = (1..runs).map do
+    IO.popen([RbConfig.ruby, "-I#{lib}", '-e', sample, mode], &:read).to_f
+  end.sort
+  times[times.size / 2]
+end
+
+cold = median.call('cold')
+warm = median.call('warm')
+puts format('%-6s first render, median of %d: cold %.3f ms, warm %.3f ms (%.1fx)',
+            type, runs, cold * 1000, warm * 1000, cold / warm)
@@ -37,4 +37,26 @@ unless find_library('plot', 'pl_newpl')
   abort "libplot is missing. Please install libplot (apt-get install libplot-dev)"
 end
 
+# Optional: compressed output streams
+have_library('z', 'gzdopen') && have_header('zlib.h')
+have_func('fopencookie', 'stdio.h') || have_func('funopen', 'stdio.h')
+
+# Optional: report the libplot canvas memory to the GC
+have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+
+# Optional: preallocation of the output files
+have_func('posix_fallocate', 'fcntl.h')
+
+# Optional: map binary data files in Plotter#plot_file
+have_header('sys/mman.h') && have_func('mmap', 'sys/mman.h')
+
+# Optional: trace contour levels on several threads without the GVL
+have_library('pthread', 'pthread_create') && have_header('pthread.h')
+have_header('ruby/thread.h') && have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+
+# Optional: Rplot.trace of the C method calls, and USDT probes
+have_header('ruby/debug.h') && have_func('rb_tracepoint_new', 'ruby/debug.h')
+have_func('rb_funcallv_kw', 'ruby.h')
+have_header('sys/sdt.h')
+
 create_makefile('rplot/rplot')
\ No newline at end of file
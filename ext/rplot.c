@@ -6,38 +6,501 @@
 
 #include "rplot.h"
 
+struct plotter
+{
+  int handler, open;
+  /* libplot writes to out, which is either the output file or a
+     zlib stream on top of it */
+  FILE *out, *file, *err;
+  int owns_out, owns_err, sync;
+  char *buffer;
+  long buffer_size, preallocated;
+  /* Estimated size of the libplot canvas, allocated while open */
+  long canvas_size;
+};
+
+/* Bitmap size of the Plotters created from now on, see parampl */
+static long bitmap_width = 570, bitmap_height = 570;
+
+/* Parameters set with parampl, by name */
+static VALUE param_values = Qnil;
+
+static void
+adjust_memory_usage (long diff)
+{
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+  rb_gc_adjust_memory_usage (diff);
+#endif
+}
+
+/* Tracing: timestamped begin (B) and end (E) events go to a ring
+   buffer preallocated by trace_start, whose slots are claimed with an
+   atomic counter, and to the USDT probes rplot:begin and rplot:end.
+   The oldest events are overwritten when the ring is full. */
+
+struct trace_event
+{
+  uint64_t time;
+  VALUE klass, thread;
+  ID method;
+  const char *name;
+  long bytes;
+  char phase;
+};
+
+static int trace_enabled;
+static struct trace_event *trace_ring;
+static unsigned long trace_capacity, trace_next;
+static uint64_t trace_origin;
+static VALUE trace_hook = Qnil;
+/* The thread traced, Qnil for all of them */
+static VALUE trace_thread = Qnil;
+/* Classes whose C methods are traced */
+static VALUE trace_classes[4];
+
+static uint64_t
+trace_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Records a C method call when method is set, or the named operation
+   with the bytes it writes */
+static void
+trace_record (char phase, VALUE klass, ID method, const char *name, long bytes)
+{
+  struct trace_event *event;
+  unsigned long slot;
+
+  if (!trace_enabled || (trace_thread != Qnil && rb_thread_current () != trace_thread))
+    return;
+#ifdef HAVE_SYS_SDT_H
+  if (phase == 'B')
+    DTRACE_PROBE2 (rplot, begin, method ? rb_id2name (method) : name, bytes);
+  else
+    DTRACE_PROBE2 (rplot, end, method ? rb_id2name (method) : name, bytes);
+#endif
+  if (trace_ring == NULL)
+    return;
+#ifdef __GNUC__
+  slot = __atomic_fetch_add (&trace_next, 1, __ATOMIC_RELAXED);
+#else
+  slot = trace_next++;
+#endif
+  event = &trace_ring[slot & (trace_capacity - 1)];
+  event->time = trace_now ();
+  event->klass = klass;
+  event->thread = rb_thread_current ();
+  event->method = method;
+  event->name = name;
+  event->bytes = bytes;
+  event->phase = phase;
+}
+
+#ifdef HAVE_RB_TRACEPOINT_NEW
+static ID id_trace_start, id_trace_stop;
+
+/* Calls of other classes are skipped before anything else */
+static void
+trace_call (VALUE tracepoint, void *data)
+{
+  rb_trace_arg_t *arg = rb_tracearg_from_tracepoint (tracepoint);
+  VALUE klass = rb_tracearg_defined_class (arg);
+  ID method;
+  int i;
+  for (i = 0; i < 4 && klass != trace_classes[i]; i++)
+    ;
+  if (i == 4)
+    return;
+  method = SYM2ID (rb_tracearg_method_id (arg));
+  if (klass == trace_classes[1] && (method == id_trace_start || method == id_trace_stop))
+    return;
+  trace_record (rb_tracearg_event_flag (arg) == RUBY_EVENT_C_CALL ? 'B' : 'E', klass, method, NULL, 0);
+}
+#endif
+
+/* Creates and enables the TracePoint, which may raise */
+static VALUE
+trace_enable (VALUE unused)
+{
+#ifdef HAVE_RB_TRACEPOINT_NEW
+  trace_hook = rb_tracepoint_new (0, RUBY_EVENT_C_CALL | RUBY_EVENT_C_RETURN, trace_call, NULL);
+#if defined(HAVE_RB_FUNCALLV_KW) && (RUBY_API_VERSION_MAJOR > 3 || (RUBY_API_VERSION_MAJOR == 3 && RUBY_API_VERSION_MINOR >= 2))
+  {
+    /* Only the calls of the tracing thread */
+    VALUE options = rb_hash_new ();
+    trace_thread = rb_thread_current ();
+    rb_hash_aset (options, ID2SYM (rb_intern ("target_thread")), trace_thread);
+    rb_funcallv_kw (trace_hook, rb_intern ("enable"), 1, &options, RB_PASS_KEYWORDS);
+  }
+#else
+  rb_tracepoint_enable (trace_hook);
+#endif
+#endif
+  return Qnil;
+}
+
+static VALUE
+trace_start (VALUE self, VALUE events)
+{
+  long n = NUM2LONG (events);
+  unsigned long capacity = 0;
+  struct trace_event *ring = NULL;
+  int state = 0;
+  if (trace_enabled)
+    rb_raise(operation_plotter_error, "Already tracing!");
+  if (n > 0)
+    {
+      for (capacity = 1; (long)capacity < n; capacity <<= 1)
+        ;
+      ring = ALLOC_N (struct trace_event, capacity);
+    }
+  /* Tracing only starts once the hook is enabled, events are ignored
+     until then */
+  rb_protect (trace_enable, Qnil, &state);
+  if (state)
+    {
+#ifdef HAVE_RB_TRACEPOINT_NEW
+      if (!NIL_P (trace_hook))
+        rb_tracepoint_disable (trace_hook);
+#endif
+      trace_hook = Qnil;
+      trace_thread = Qnil;
+      xfree (ring);
+      rb_jump_tag (state);
+    }
+  trace_ring = ring;
+  trace_capacity = capacity;
+  trace_next = 0;
+  trace_origin = trace_now ();
+  trace_enabled = 1;
+  return Qnil;
+}
+
+static const char *
+trace_category (const struct trace_event *event)
+{
+  if (event->method)
+    return rb_class2name (event->klass == trace_classes[1] ? trace_classes[0] : event->klass);
+  return strncmp (event->name, "pl_", 3) == 0 ? "libplot" : "io";
+}
+
+static VALUE
+trace_stop (VALUE self, VALUE path)
+{
+  unsigned long count, i, j, threads = 0;
+  VALUE thread_ids[64];
+  FILE *file = NULL;
+  const char *separator = "";
+
+  if (!trace_enabled)
+    return Qnil;
+#ifdef HAVE_RB_TRACEPOINT_NEW
+  rb_tracepoint_disable (trace_hook);
+  trace_hook = Qnil;
+#endif
+  trace_enabled = 0;
+  trace_thread = Qnil;
+  if (trace_ring == NULL)
+    return INT2FIX (0);
+  count = trace_next < trace_capacity ? trace_next : trace_capacity;
+  if (!NIL_P (path) && (file = fopen (StringValueCStr (path), "w")) == NULL)
+    {
+      xfree (trace_ring);
+      trace_ring = NULL;
+      rb_raise(operation_plotter_error, "Couldn't open %s: %s!", StringValuePtr (path), strerror (errno));
+    }
+  if (file != NULL)
+    {
+      /* Chrome trace event format, in microseconds from trace_start,
+         with Ruby threads numbered in order of appearance */
+      fputs ("{\"traceEvents\":[", file);
+      for (i = trace_next - count; i < trace_next; i++)
+        {
+          struct trace_event *event = &trace_ring[i & (trace_capacity - 1)];
+          for (j = 0; j < threads && thread_ids[j] != event->thread; j++)
+            ;
+          if (j == threads && threads < 64)
+            thread_ids[threads++] = event->thread;
+          fprintf (file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%lu",
+                   separator, event->method ? rb_id2name (event->method) : event->name,
+                   trace_category (event), event->phase,
+                   (double)(event->time - trace_origin) / 1000, (int)getpid (), j + 1);
+          if (event->bytes > 0)
+            fprintf (file, ",\"args\":{\"bytes\":%ld}", event->bytes);
+          fputc ('}', file);
+          separator = ",";
+        }
+      fprintf (file, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%lu}}\n", trace_next - count);
+      fclose (file);
+    }
+  xfree (trace_ring);
+  trace_ring = NULL;
+  return ULONG2NUM (count);
+}
+
+/* Bitmap Plotters draw on a canvas of one miPixel (4 bytes) per
+   pixel, GIF Plotters keep an indexed frame as well. */
+static long
+canvas_size (const char *type)
+{
+  long pixels = bitmap_width * bitmap_height;
+  if (strcmp (type, "pnm") == 0 || strcmp (type, "png") == 0)
+    return 4 * pixels;
+  if (strcmp (type, "gif") == 0)
+    return 5 * pixels;
+  return 0;
+}
+
+static void
+plotter_close_streams (struct plotter *plotter)
+{
+  if (plotter->owns_out)
+    {
+      off_t size;
+      trace_record ('B', Qnil, 0, "flush", 0);
+      fflush (plotter->out);
+      /* A compressing stream is finished before the file under it */
+      if (plotter->out != plotter->file)
+        fclose (plotter->out);
+      size = lseek (fileno (plotter->file), 0, SEEK_CUR);
+      /* Preallocated space past the end of the output is given back */
+      if (plotter->preallocated > 0 && size >= 0 && size < plotter->preallocated)
+        while (ftruncate (fileno (plotter->file), size) < 0 && errno == EINTR)
+          ;
+      if (plotter->sync)
+        fsync (fileno (plotter->file));
+      fclose (plotter->file);
+      trace_record ('E', Qnil, 0, "flush", 0);
+    }
+  if (plotter->owns_err)
+    fclose (plotter->err);
+  plotter->out = plotter->file = plotter->err = NULL;
+  plotter->owns_out = plotter->owns_err = 0;
+  xfree (plotter->buffer);
+  adjust_memory_usage (-plotter->buffer_size);
+  plotter->buffer = NULL;
+  plotter->buffer_size = 0;
+}
+
+/* Deletes the libplot Plotter, if any, without changing the selected
+   one, then closes the streams it owned. */
+static int
+plotter_release (struct plotter *plotter)
+{
+  int result = 0;
+  if (plotter->handler > 0)
+    {
+      int previous = pl_selectpl (plotter->handler);
+      if (plotter->open)
+        {
+          pl_closepl ();
+          adjust_memory_usage (-plotter->canvas_size);
+        }
+      pl_selectpl (0);
+      result = pl_deletepl (plotter->handler);
+      pl_selectpl (previous != plotter->handler && previous >= 0 ? previous : 0);
+      plotter->handler = -1;
+      plotter->open = 0;
+    }
+  plotter_close_streams (plotter);
+  return result;
+}
+
+static void
+plotter_free (void *data)
+{
+  plotter_release (data);
+  xfree (data);
+}
+
+static size_t
+plotter_memsize (const void *data)
+{
+  const struct plotter *plotter = data;
+  return sizeof (struct plotter) + plotter->buffer_size + (plotter->open ? plotter->canvas_size : 0);
+}
+
+static const rb_data_type_t plotter_data_type = {
+  "Rplot",
+  { NULL, plotter_free, plotter_memsize, },
+  NULL, NULL, 0
+};
+
+static VALUE
+plotter_alloc (VALUE klass)
+{
+  struct plotter *plotter;
+  VALUE obj = TypedData_Make_Struct (klass, struct plotter, &plotter_data_type, plotter);
+  plotter->handler = -1;
+  return obj;
+}
+
+static struct plotter *
+get_plotter (VALUE self)
+{
+  struct plotter *plotter;
+  TypedData_Get_Struct (self, struct plotter, &plotter_data_type, plotter);
+  return plotter;
+}
+
 static int
 get_handler (VALUE self)
 {
-  int handler = NUM2INT (rb_iv_get (self, "@handler"));
-  if (pl_selectpl (handler) < 0)
+  int handler = get_plotter (self)->handler;
+  if (handler < 0 || pl_selectpl (handler) < 0)
     rb_raise(select_plotter_error, "Couldn't select Plotter with id %d!", handler);
   return handler;
 }
 
+static const double *
+get_doubles (VALUE buffer, long *count)
+{
+  StringValue (buffer);
+  if (RSTRING_LEN (buffer) % sizeof (double) != 0)
+    rb_raise(rb_eArgError, "Packed buffer size is not a multiple of %d bytes!", (int)sizeof (double));
+  *count = RSTRING_LEN (buffer) / sizeof (double);
+  return (const double *)RSTRING_PTR (buffer);
+}
+
+/* Reads a [x0, y0, x1, y1] window */
+static void
+get_window (VALUE window, double *win)
+{
+  int i;
+  Check_Type (window, T_ARRAY);
+  if (RARRAY_LEN (window) != 4)
+    rb_raise(rb_eArgError, "Window must be [x0, y0, x1, y1]!");
+  for (i = 0; i < 4; i++)
+    win[i] = NUM2DBL (rb_ary_entry (window, i));
+}
+
 /* 4 base functions */
 
-static VALUE
-newpl (VALUE self, VALUE type, VALUE in_path, VALUE out_path, VALUE err_path)
+static FILE *
+open_stream (VALUE path, FILE *standard, int *owned)
 {
-  FILE *in_file, *out_file, *err_file;
-  if (TYPE (in_path) == T_NIL)
-    in_file = stdin;
-  else
-    in_file = fopen (StringValuePtr (in_path), "w");
-  if (TYPE (out_path) == T_NIL)
-    out_file = stdout;
-  else
-    out_file = fopen (StringValuePtr (out_path), "w");
-  if (TYPE (err_path) == T_NIL)
-    err_file = stderr;
-  else
-    err_file = fopen (StringValuePtr (err_path), "w");
+  FILE *file;
+  if (NIL_P (path))
+    return standard;
+  file = fopen (StringValuePtr (path), "w");
+  if (file == NULL)
+    rb_raise(create_plotter_error, "Couldn't open %s: %s!", StringValuePtr (path), strerror (errno));
+  *owned = 1;
+  return file;
+}
 
-  int handler = pl_newpl (StringValuePtr (type), stdin, out_file, stderr);
+#if defined(HAVE_ZLIB_H) && (defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN))
+#define HAVE_COMPRESSED_STREAMS 1
+
+#ifdef HAVE_FOPENCOOKIE
+static ssize_t
+gzip_write (void *cookie, const char *buf, size_t size)
+#else
+static int
+gzip_write (void *cookie, const char *buf, int size)
+#endif
+{
+  int written;
+  if (size == 0)
+    return 0;
+  trace_record ('B', Qnil, 0, "write", (long)size);
+  written = gzwrite ((gzFile)cookie, buf, (unsigned)size);
+  trace_record ('E', Qnil, 0, "write", (long)size);
+  return written > 0 ? (ssize_t)size : -1;
+}
+
+static int
+gzip_close (void *cookie)
+{
+  return gzclose ((gzFile)cookie) == Z_OK ? 0 : EOF;
+}
+
+/* A stdio stream deflating into a dup of the descriptor of file, so
+   that the compressed output goes out in a single pass. */
+static FILE *
+open_gzip_stream (FILE *file, int level)
+{
+  char mode[4] = "wb";
+  gzFile gz;
+  FILE *stream;
+  int fd = dup (fileno (file));
+  if (level >= 0 && level <= 9)
+    mode[2] = '0' + level;
+  if (fd < 0 || (gz = gzdopen (fd, mode)) == NULL)
+    {
+      if (fd >= 0)
+        close (fd);
+      return NULL;
+    }
+#ifdef HAVE_FOPENCOOKIE
+  {
+    cookie_io_functions_t functions = { NULL, gzip_write, NULL, gzip_close };
+    stream = fopencookie (gz, "w", functions);
+  }
+#else
+  stream = funopen (gz, NULL, gzip_write, NULL, gzip_close);
+#endif
+  if (stream == NULL)
+    gzclose (gz);
+  return stream;
+}
+#endif
+
+static VALUE
+newpl (VALUE self, VALUE type, VALUE in_path, VALUE out_path, VALUE err_path, VALUE buffer_size, VALUE preallocate, VALUE sync, VALUE compress)
+{
+  struct plotter *plotter = get_plotter (self);
+  int handler;
+
+  /* All Plotters are write-only: in_path is never opened */
+  if (plotter->handler >= 0)
+    rb_raise(create_plotter_error, "Plotter already created!");
+  StringValue (type);
+  /* stdout is not owned, so it is neither buffered nor compressed here */
+  if (NIL_P (out_path) && (!NIL_P (buffer_size) || !NIL_P (preallocate) || !NIL_P (compress)))
+    rb_raise(rb_eArgError, "The buffer_size, preallocate and compress options need an output path!");
+  plotter->file = plotter->out = open_stream (out_path, stdout, &plotter->owns_out);
+  plotter->err = open_stream (err_path, stderr, &plotter->owns_err);
+  plotter->sync = RTEST (sync);
+#ifdef HAVE_POSIX_FALLOCATE
+  if (plotter->owns_out && !NIL_P (preallocate) && NUM2LONG (preallocate) > 0
+      && posix_fallocate (fileno (plotter->file), 0, NUM2LONG (preallocate)) == 0)
+    plotter->preallocated = NUM2LONG (preallocate);
+#endif
+  if (plotter->owns_out && !NIL_P (compress))
+    {
+#ifdef HAVE_COMPRESSED_STREAMS
+      plotter->out = open_gzip_stream (plotter->file, NUM2INT (compress));
+      if (plotter->out == NULL)
+        {
+          plotter->out = plotter->file;
+          plotter_close_streams (plotter);
+          rb_raise(create_plotter_error, "Couldn't open a compressed stream on %s!", StringValuePtr (out_path));
+        }
+#else
+      plotter_close_streams (plotter);
+      rb_raise(create_plotter_error, "Compressed output is not supported!");
+#endif
+    }
+  if (plotter->owns_out && !NIL_P (buffer_size) && NUM2LONG (buffer_size) > 0)
+    {
+      plotter->buffer_size = NUM2LONG (buffer_size);
+      plotter->buffer = ALLOC_N (char, plotter->buffer_size);
+      setvbuf (plotter->out, plotter->buffer, _IOFBF, plotter->buffer_size);
+      adjust_memory_usage (plotter->buffer_size);
+    }
+
+  handler = pl_newpl (RSTRING_PTR (type), stdin, plotter->out, plotter->err);
   if (handler < 0)
-    rb_raise(create_plotter_error, "Couldn't create Plotter!");
-  rb_iv_set (self, "@handler", INT2NUM (handler));
+    {
+      plotter_close_streams (plotter);
+      rb_raise(create_plotter_error, "Couldn't create Plotter!");
+    }
+  plotter->handler = handler;
+  plotter->canvas_size = canvas_size (RSTRING_PTR (type));
   return self;
 }
 
@@ -48,20 +511,59 @@ newpl (VALUE self, VALUE type, VALUE in_path, VALUE out_path, VALUE err_path)
 //   Use an object-oriented style.
 // }
 
+static VALUE
+deletedpl (VALUE self)
+{
+  return get_plotter (self)->handler < 0 ? Qtrue : Qfalse;
+}
+
+static VALUE
+memsizepl (VALUE self)
+{
+  return SIZET2NUM (plotter_memsize (get_plotter (self)));
+}
+
 static VALUE
 deletepl (VALUE self) {
   int handler = get_handler (self);
-  pl_closepl ();
-  pl_selectpl (0);
-  if (pl_deletepl (handler) < 0)
+  if (plotter_release (get_plotter (self)) < 0)
     rb_raise(delete_plotter_error, "Couldn't delete Plotter with id %d!", handler);
   return INT2FIX (0);
 }
 
+static VALUE
+current_params (VALUE self)
+{
+  return rb_hash_dup (param_values);
+}
+
 static VALUE
 parampl (VALUE self, VALUE param, VALUE value)
 {
-  return INT2FIX (pl_parampl (StringValuePtr (param), (void*)(StringValuePtr (value))));
+  int result;
+  /* A nil value unsets the parameter, back to its default */
+  if (NIL_P (value))
+    {
+      result = pl_parampl (StringValuePtr (param), NULL);
+      if (result == 0)
+        rb_hash_delete (param_values, param);
+      if (result == 0 && strcmp (RSTRING_PTR (param), "BITMAPSIZE") == 0)
+        bitmap_width = bitmap_height = 570;
+      return INT2FIX (result);
+    }
+  result = pl_parampl (StringValuePtr (param), (void*)(StringValuePtr (value)));
+  if (result == 0)
+    rb_hash_aset (param_values, rb_str_new_frozen (param), rb_str_new_frozen (value));
+  if (result == 0 && strcmp (RSTRING_PTR (param), "BITMAPSIZE") == 0)
+    {
+      long width, height;
+      if (sscanf (RSTRING_PTR (value), "%ldx%ld", &width, &height) == 2 && width > 0 && height > 0)
+        {
+          bitmap_width = width;
+          bitmap_height = height;
+        }
+    }
+  return INT2FIX (result);
 }
 
 /* Setup functions */
@@ -69,15 +571,24 @@ parampl (VALUE self, VALUE param, VALUE value)
 static VALUE
 openpl (VALUE self)
 {
+  struct plotter *plotter = get_plotter (self);
+  int result;
   get_handler (self);
-  if (pl_openpl () < 0)
+  trace_record ('B', Qnil, 0, "pl_openpl", 0);
+  result = pl_openpl ();
+  trace_record ('E', Qnil, 0, "pl_openpl", 0);
+  if (result < 0)
     rb_raise(open_plotter_error, "Couldn't open Plotter!");
+  if (!plotter->open)
+    adjust_memory_usage (plotter->canvas_size);
+  plotter->open = 1;
   return INT2FIX (0);
 }
 
 static VALUE
 bgcolor (VALUE self, VALUE red, VALUE green, VALUE blue)
 {
+  get_handler (self);
   return INT2FIX (pl_bgcolor (FIX2INT (red),
                               FIX2INT (green),
                               FIX2INT (blue)));
@@ -120,6 +631,7 @@ fspace (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 static VALUE
 space2 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_space2 (FIX2INT (x0),
                              FIX2INT (y0),
                              FIX2INT (x1),
@@ -131,6 +643,7 @@ space2 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 static VALUE
 fspace2 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_fspace2 (NUM2DBL (x0),
                               NUM2DBL (y0),
                               NUM2DBL (x1),
@@ -142,37 +655,57 @@ fspace2 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 static VALUE
 havecap (VALUE self, VALUE s)
 {
+  get_handler (self);
   return INT2FIX (pl_havecap (StringValuePtr (s)));
 }
 
 static VALUE
 flushpl (VALUE self)
 {
+  get_handler (self);
   return INT2FIX (pl_flushpl ());
 }
 
 static VALUE
 closepl (VALUE self)
 {
+  struct plotter *plotter = get_plotter (self);
+  int result;
   get_handler (self);
-  if (pl_closepl () < 0)
+  if (plotter->open)
+    adjust_memory_usage (-plotter->canvas_size);
+  plotter->open = 0;
+  trace_record ('B', Qnil, 0, "pl_closepl", 0);
+  result = pl_closepl ();
+  trace_record ('E', Qnil, 0, "pl_closepl", 0);
+  if (result < 0)
     rb_raise(close_plotter_error, "Couldn't close Plotter!");
   return INT2FIX (0);
 }
 
 /* Object-drawing functions */
 
+static int
+get_justify (VALUE justify)
+{
+  if (TYPE (justify) == T_STRING)
+    return RSTRING_LEN (justify) > 0 ? (unsigned char)RSTRING_PTR (justify)[0] : 0;
+  return FIX2INT (justify);
+}
+
 static VALUE
 alabel (VALUE self, VALUE horiz_justify, VALUE vert_justify, VALUE s)
 {
-  return INT2FIX (pl_alabel (FIX2INT (horiz_justify),
-                             FIX2INT (vert_justify),
+  get_handler (self);
+  return INT2FIX (pl_alabel (get_justify (horiz_justify),
+                             get_justify (vert_justify),
                              StringValuePtr (s)));
 }
 
 static VALUE
 arc (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 {
+  get_handler (self);
   return INT2FIX (pl_arc (FIX2INT (xc),
                           FIX2INT (yc),
                           FIX2INT (x0),
@@ -184,6 +717,7 @@ arc (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 static VALUE
 farc (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 {
+  get_handler (self);
   return INT2FIX (pl_farc (NUM2DBL (xc),
                            NUM2DBL (yc),
                            NUM2DBL (x0),
@@ -195,6 +729,7 @@ farc (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 static VALUE
 arcrel (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 {
+  get_handler (self);
   return INT2FIX (pl_arcrel (FIX2INT (xc),
                              FIX2INT (yc),
                              FIX2INT (x0),
@@ -206,6 +741,7 @@ arcrel (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 static VALUE
 farcrel (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 {
+  get_handler (self);
   return INT2FIX (pl_farcrel (NUM2DBL (xc),
                               NUM2DBL (yc),
                               NUM2DBL (x0),
@@ -217,6 +753,7 @@ farcrel (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 static VALUE
 bezier2 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_bezier2 (FIX2INT (x0),
                               FIX2INT (y0),
                               FIX2INT (x1),
@@ -228,6 +765,7 @@ bezier2 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 static VALUE
 fbezier2 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_fbezier2 (NUM2DBL (x0),
                                NUM2DBL (y0),
                                NUM2DBL (x1),
@@ -239,6 +777,7 @@ fbezier2 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2
 static VALUE
 bezier2rel (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_bezier2rel (FIX2INT (x0),
                                  FIX2INT (y0),
                                  FIX2INT (x1),
@@ -250,6 +789,7 @@ bezier2rel (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE
 static VALUE
 fbezier2rel (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_fbezier2rel (NUM2DBL (x0),
                                   NUM2DBL (y0),
                                   NUM2DBL (x1),
@@ -261,6 +801,7 @@ fbezier2rel (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE
 static VALUE
 bezier3 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2, VALUE x3, VALUE y3)
 {
+  get_handler (self);
   return INT2FIX (pl_bezier3 (FIX2INT (x0),
                               FIX2INT (y0),
                               FIX2INT (x1),
@@ -274,6 +815,7 @@ bezier3 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2,
 static VALUE
 fbezier3 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2, VALUE x3, VALUE y3)
 {
+  get_handler (self);
   return INT2FIX (pl_fbezier3 (NUM2DBL (x0),
                                NUM2DBL (y0),
                                NUM2DBL (x1),
@@ -287,6 +829,7 @@ fbezier3 (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2
 static VALUE
 bezier3rel (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2, VALUE x3, VALUE y3)
 {
+  get_handler (self);
   return INT2FIX (pl_bezier3rel (FIX2INT (x0),
                                  FIX2INT (y0),
                                  FIX2INT (x1),
@@ -300,6 +843,7 @@ bezier3rel (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE
 static VALUE
 fbezier3rel (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE y2, VALUE x3, VALUE y3)
 {
+  get_handler (self);
   return INT2FIX (pl_fbezier3rel (NUM2DBL (x0),
                                   NUM2DBL (y0),
                                   NUM2DBL (x1),
@@ -313,6 +857,7 @@ fbezier3rel (VALUE self, VALUE x0, VALUE y0, VALUE x1, VALUE y1, VALUE x2, VALUE
 static VALUE
 box (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_box (FIX2INT (x1),
                           FIX2INT (y1),
                           FIX2INT (x2),
@@ -322,6 +867,7 @@ box (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 static VALUE
 fbox (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_fbox (NUM2DBL (x1),
                            NUM2DBL (y1),
                            NUM2DBL (x2),
@@ -331,6 +877,7 @@ fbox (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 static VALUE
 boxrel (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_boxrel (FIX2INT (x1),
                              FIX2INT (y1),
                              FIX2INT (x2),
@@ -340,6 +887,7 @@ boxrel (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 static VALUE
 fboxrel (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_fboxrel (NUM2DBL (x1),
                               NUM2DBL (y1),
                               NUM2DBL (x2),
@@ -349,6 +897,7 @@ fboxrel (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 static VALUE
 circle (VALUE self, VALUE xc, VALUE yc, VALUE r)
 {
+  get_handler (self);
   return INT2FIX (pl_circle (FIX2INT (xc),
                              FIX2INT (yc),
                              FIX2INT (r)));
@@ -357,6 +906,7 @@ circle (VALUE self, VALUE xc, VALUE yc, VALUE r)
 static VALUE
 fcircle (VALUE self, VALUE xc, VALUE yc, VALUE r)
 {
+  get_handler (self);
   return INT2FIX (pl_fcircle (NUM2DBL (xc),
                               NUM2DBL (yc),
                               NUM2DBL (r)));
@@ -365,6 +915,7 @@ fcircle (VALUE self, VALUE xc, VALUE yc, VALUE r)
 static VALUE
 circlerel (VALUE self, VALUE xc, VALUE yc, VALUE r)
 {
+  get_handler (self);
   return INT2FIX (pl_circlerel (FIX2INT (xc),
                                 FIX2INT (yc),
                                 FIX2INT (r)));
@@ -373,6 +924,7 @@ circlerel (VALUE self, VALUE xc, VALUE yc, VALUE r)
 static VALUE
 fcirclerel (VALUE self, VALUE xc, VALUE yc, VALUE r)
 {
+  get_handler (self);
   return INT2FIX (pl_fcirclerel (NUM2DBL (xc),
                                  NUM2DBL (yc),
                                  NUM2DBL (r)));
@@ -381,6 +933,7 @@ fcirclerel (VALUE self, VALUE xc, VALUE yc, VALUE r)
 static VALUE
 cont (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_cont (FIX2INT (x),
                            FIX2INT (y)));
 }
@@ -388,6 +941,7 @@ cont (VALUE self, VALUE x, VALUE y)
 static VALUE
 fcont (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_fcont (NUM2DBL (x),
                             NUM2DBL (y)));
 }
@@ -395,6 +949,7 @@ fcont (VALUE self, VALUE x, VALUE y)
 static VALUE
 contrel (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_contrel (FIX2INT (x),
                               FIX2INT (y)));
 }
@@ -402,6 +957,7 @@ contrel (VALUE self, VALUE x, VALUE y)
 static VALUE
 fcontrel (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_fcontrel (NUM2DBL (x),
                                NUM2DBL (y)));
 }
@@ -409,6 +965,7 @@ fcontrel (VALUE self, VALUE x, VALUE y)
 static VALUE
 ellarc (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 {
+  get_handler (self);
   return INT2FIX (pl_ellarc (FIX2INT (xc),
                              FIX2INT (yc),
                              FIX2INT (x0),
@@ -420,6 +977,7 @@ ellarc (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 static VALUE
 fellarc (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 {
+  get_handler (self);
   return INT2FIX (pl_fellarc (NUM2DBL (xc),
                               NUM2DBL (yc),
                               NUM2DBL (x0),
@@ -431,6 +989,7 @@ fellarc (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 static VALUE
 ellarcrel (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 {
+  get_handler (self);
   return INT2FIX (pl_ellarcrel (FIX2INT (xc),
                                 FIX2INT (yc),
                                 FIX2INT (x0),
@@ -442,6 +1001,7 @@ ellarcrel (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y
 static VALUE
 fellarcrel (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
 {
+  get_handler (self);
   return INT2FIX (pl_fellarcrel (NUM2DBL (xc),
                                  NUM2DBL (yc),
                                  NUM2DBL (x0),
@@ -453,6 +1013,7 @@ fellarcrel (VALUE self, VALUE xc, VALUE yc, VALUE x0, VALUE y0, VALUE x1, VALUE
 static VALUE
 ellipse (VALUE self, VALUE xc, VALUE yc, VALUE rx, VALUE ry, VALUE angle)
 {
+  get_handler (self);
   return INT2FIX (pl_ellipse (FIX2INT (xc),
                               FIX2INT (yc),
                               FIX2INT (rx),
@@ -463,6 +1024,7 @@ ellipse (VALUE self, VALUE xc, VALUE yc, VALUE rx, VALUE ry, VALUE angle)
 static VALUE
 fellipse (VALUE self, VALUE xc, VALUE yc, VALUE rx, VALUE ry, VALUE angle)
 {
+  get_handler (self);
   return INT2FIX (pl_fellipse (NUM2DBL (xc),
                                NUM2DBL (yc),
                                NUM2DBL (rx),
@@ -473,6 +1035,7 @@ fellipse (VALUE self, VALUE xc, VALUE yc, VALUE rx, VALUE ry, VALUE angle)
 static VALUE
 ellipserel (VALUE self, VALUE xc, VALUE yc, VALUE rx, VALUE ry, VALUE angle)
 {
+  get_handler (self);
   return INT2FIX (pl_ellipserel (FIX2INT (xc),
                                  FIX2INT (yc),
                                  FIX2INT (rx),
@@ -483,6 +1046,7 @@ ellipserel (VALUE self, VALUE xc, VALUE yc, VALUE rx, VALUE ry, VALUE angle)
 static VALUE
 fellipserel (VALUE self, VALUE xc, VALUE yc, VALUE rx, VALUE ry, VALUE angle)
 {
+  get_handler (self);
   return INT2FIX (pl_fellipserel (NUM2DBL (xc),
                                   NUM2DBL (yc),
                                   NUM2DBL (rx),
@@ -493,24 +1057,28 @@ fellipserel (VALUE self, VALUE xc, VALUE yc, VALUE rx, VALUE ry, VALUE angle)
 static VALUE
 endpath (VALUE self)
 {
+  get_handler (self);
   return INT2FIX (pl_endpath ());
 }
 
 static VALUE
 label (VALUE self, VALUE s)
 {
+  get_handler (self);
   return INT2FIX (pl_label (StringValuePtr (s)));
 }
 
 static VALUE
 labelwidth (VALUE self, VALUE s)
 {
+  get_handler (self);
   return INT2FIX (pl_labelwidth (StringValuePtr (s)));
 }
 
 static VALUE
 flabelwidth (VALUE self, VALUE s)
 {
+  get_handler (self);
   return DBL2NUM (pl_flabelwidth (StringValuePtr (s)));
 }
 
@@ -537,6 +1105,7 @@ fline (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 static VALUE
 linerel (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_linerel (FIX2INT (x1),
                               FIX2INT (y1),
                               FIX2INT (x2),
@@ -546,6 +1115,7 @@ linerel (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 static VALUE
 flinerel (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 {
+  get_handler (self);
   return INT2FIX (pl_flinerel (NUM2DBL (x1),
                                NUM2DBL (y1),
                                NUM2DBL (x2),
@@ -555,6 +1125,7 @@ flinerel (VALUE self, VALUE x1, VALUE y1, VALUE x2, VALUE y2)
 static VALUE
 marker (VALUE self, VALUE x, VALUE y, VALUE type, VALUE size)
 {
+  get_handler (self);
   return INT2FIX (pl_marker (FIX2INT (x),
                              FIX2INT (y),
                              FIX2INT (type),
@@ -564,6 +1135,7 @@ marker (VALUE self, VALUE x, VALUE y, VALUE type, VALUE size)
 static VALUE
 fmarker (VALUE self, VALUE x, VALUE y, VALUE type, VALUE size)
 {
+  get_handler (self);
   return INT2FIX (pl_fmarker (NUM2DBL (x),
                               NUM2DBL (y),
                               FIX2INT (type),
@@ -573,6 +1145,7 @@ fmarker (VALUE self, VALUE x, VALUE y, VALUE type, VALUE size)
 static VALUE
 markerrel (VALUE self, VALUE x, VALUE y, VALUE type, VALUE size)
 {
+  get_handler (self);
   return INT2FIX (pl_markerrel (FIX2INT (x),
                                 FIX2INT (y),
                                 FIX2INT (type),
@@ -582,6 +1155,7 @@ markerrel (VALUE self, VALUE x, VALUE y, VALUE type, VALUE size)
 static VALUE
 fmarkerrel (VALUE self, VALUE x, VALUE y, VALUE type, VALUE size)
 {
+  get_handler (self);
   return INT2FIX (pl_fmarkerrel (NUM2DBL (x),
                                  NUM2DBL (y),
                                  FIX2INT (type),
@@ -591,6 +1165,7 @@ fmarkerrel (VALUE self, VALUE x, VALUE y, VALUE type, VALUE size)
 static VALUE
 point (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_point (FIX2INT (x),
                             FIX2INT (y)));
 }
@@ -598,6 +1173,7 @@ point (VALUE self, VALUE x, VALUE y)
 static VALUE
 fpoint (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_fpoint (NUM2DBL (x),
                              NUM2DBL (y)));
 }
@@ -605,6 +1181,7 @@ fpoint (VALUE self, VALUE x, VALUE y)
 static VALUE
 pointrel (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_pointrel (FIX2INT (x),
                                FIX2INT (y)));
 }
@@ -612,6 +1189,7 @@ pointrel (VALUE self, VALUE x, VALUE y)
 static VALUE
 fpointrel (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_fpoint (NUM2DBL (x),
                              NUM2DBL (y)));
 }
@@ -621,12 +1199,14 @@ fpointrel (VALUE self, VALUE x, VALUE y)
 static VALUE
 capmod (VALUE self, VALUE s)
 {
+  get_handler (self);
   return INT2FIX (pl_capmod (StringValuePtr (s)));
 }
 
 static VALUE
 color (VALUE self, VALUE red, VALUE green, VALUE blue)
 {
+  get_handler (self);
   return INT2FIX (pl_color (FIX2INT (red),
                             FIX2INT (green),
                             FIX2INT (blue)));
@@ -635,12 +1215,14 @@ color (VALUE self, VALUE red, VALUE green, VALUE blue)
 static VALUE
 colorname (VALUE self, VALUE name)
 {
+  get_handler (self);
   return INT2FIX (pl_colorname (StringValuePtr (name)));
 }
 
 static VALUE
 fillcolor (VALUE self, VALUE red, VALUE green, VALUE blue)
 {
+  get_handler (self);
   return INT2FIX (pl_fillcolor (FIX2INT (red),
                                 FIX2INT (green),
                                 FIX2INT (blue)));
@@ -649,58 +1231,68 @@ fillcolor (VALUE self, VALUE red, VALUE green, VALUE blue)
 static VALUE
 fillcolorname (VALUE self, VALUE name)
 {
+  get_handler (self);
   return INT2FIX (pl_fillcolorname (StringValuePtr (name)));
 }
 
 static VALUE
 fillmod (VALUE self, VALUE s)
 {
+  get_handler (self);
   return INT2FIX (pl_fillmod (StringValuePtr (s)));
 }
 
 static VALUE filltype (VALUE self, VALUE level)
 {
+  get_handler (self);
   return INT2FIX (pl_filltype (FIX2INT (level)));
 }
 
 static VALUE
 fmiterlimit (VALUE self, VALUE limit)
 {
+  get_handler (self);
   return INT2FIX (pl_fmiterlimit (NUM2DBL (limit)));
 }
 
 static VALUE
 fontname (VALUE self, VALUE font_name)
 {
+  get_handler (self);
   return INT2FIX (pl_fontname (StringValuePtr (font_name)));
 }
 
 static VALUE
 ffontname (VALUE self, VALUE font_name)
 {
+  get_handler (self);
   return DBL2NUM (pl_ffontname (StringValuePtr (font_name)));
 }
 
 static VALUE
 fontsize (VALUE self, VALUE size)
 {
+  get_handler (self);
   return INT2FIX (pl_fontsize (FIX2INT (size)));
 }
 
 static VALUE ffontsize (VALUE self, VALUE size)
 {
+  get_handler (self);
   return DBL2NUM (pl_ffontsize (NUM2DBL (size)));
 }
 
 static VALUE
 joinmod (VALUE self, VALUE s)
 {
+  get_handler (self);
   return INT2FIX (pl_joinmod (StringValuePtr (s)));
 }
 
 static VALUE
 linedash (VALUE self, VALUE n, VALUE dashes, VALUE offset)
 {
+  get_handler (self);
   int size = RARRAY_LEN (dashes); // Use n instead?
   VALUE *dashes_p = RARRAY_PTR (dashes);
   int c_dashes[size];
@@ -714,6 +1306,7 @@ linedash (VALUE self, VALUE n, VALUE dashes, VALUE offset)
 static VALUE
 flinedash (VALUE self, VALUE n, VALUE dashes, VALUE offset)
 {
+  get_handler (self);
   int size = RARRAY_LEN (dashes); // Use n instead?
   VALUE *dashes_p = RARRAY_PTR (dashes);
   double c_dashes[size];
@@ -727,24 +1320,28 @@ flinedash (VALUE self, VALUE n, VALUE dashes, VALUE offset)
 static VALUE
 linemod (VALUE self, VALUE s)
 {
+  get_handler (self);
   return INT2FIX (pl_linemod (StringValuePtr (s)));
 }
 
 static VALUE
 linewidth (VALUE self, VALUE size)
 {
+  get_handler (self);
   return INT2FIX (pl_linewidth (FIX2INT (size)));
 }
 
 static VALUE
 flinewidth (VALUE self, VALUE size)
 {
+  get_handler (self);
   return INT2FIX (pl_flinewidth (NUM2DBL (size)));
 }
 
 static VALUE
 move (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_move (FIX2INT (x),
                            FIX2INT (y)));
 }
@@ -752,6 +1349,7 @@ move (VALUE self, VALUE x, VALUE y)
 static VALUE
 fmove (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_fmove (NUM2DBL (x),
                             NUM2DBL (y)));
 }
@@ -759,6 +1357,7 @@ fmove (VALUE self, VALUE x, VALUE y)
 static VALUE
 moverel (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_moverel (FIX2INT (x),
                               FIX2INT (y)));
 }
@@ -766,6 +1365,7 @@ moverel (VALUE self, VALUE x, VALUE y)
 static VALUE
 fmoverel (VALUE self, VALUE x, VALUE y)
 {
+  get_handler (self);
   return INT2FIX (pl_fmoverel (NUM2DBL (x),
                                NUM2DBL (y)));
 }
@@ -773,6 +1373,7 @@ fmoverel (VALUE self, VALUE x, VALUE y)
 static VALUE
 pencolor (VALUE self, VALUE red, VALUE green, VALUE blue)
 {
+  get_handler (self);
   return INT2FIX (pl_pencolor (FIX2INT (red),
                                FIX2INT (green),
                                FIX2INT (blue)));
@@ -781,30 +1382,35 @@ pencolor (VALUE self, VALUE red, VALUE green, VALUE blue)
 static VALUE
 pencolorname (VALUE self, VALUE name)
 {
+  get_handler (self);
   return INT2FIX (pl_pencolorname (StringValuePtr (name)));
 }
 
 static VALUE
 restorestate (VALUE self)
 {
+  get_handler (self);
   return INT2FIX (pl_restorestate ());
 }
 
 static VALUE
 savestate (VALUE self)
 {
+  get_handler (self);
   return INT2FIX (pl_savestate ());
 }
 
 static VALUE
 textangle (VALUE self, VALUE angle)
 {
+  get_handler (self);
   return INT2FIX (pl_textangle (FIX2INT (angle)));
 }
 
 static VALUE
 ftextangle (VALUE self, VALUE angle)
 {
+  get_handler (self);
   return DBL2NUM (pl_ftextangle (NUM2DBL (angle)));
 }
 
@@ -813,6 +1419,7 @@ ftextangle (VALUE self, VALUE angle)
 static VALUE
 fconcat (VALUE self, VALUE m0, VALUE m1, VALUE m2, VALUE m3, VALUE tx, VALUE ty)
 {
+  get_handler (self);
   return INT2FIX (pl_fconcat (NUM2DBL (m0),
                               NUM2DBL (m1),
                               NUM2DBL (m2),
@@ -824,12 +1431,14 @@ fconcat (VALUE self, VALUE m0, VALUE m1, VALUE m2, VALUE m3, VALUE tx, VALUE ty)
 static VALUE
 frotate (VALUE self, VALUE theta)
 {
+  get_handler (self);
   return INT2FIX (pl_frotate (NUM2DBL (theta)));
 }
 
 static VALUE
 fscale (VALUE self, VALUE sx, VALUE sy)
 {
+  get_handler (self);
   return INT2FIX (pl_fscale (NUM2DBL (sx),
                              NUM2DBL (sy)));
 }
@@ -837,10 +1446,2261 @@ fscale (VALUE self, VALUE sx, VALUE sy)
 static VALUE
 ftranslate (VALUE self, VALUE tx, VALUE ty)
 {
+  get_handler (self);
   return INT2FIX (pl_ftranslate (NUM2DBL (tx),
                                  NUM2DBL (ty)));
 }
 
+/* Batch functions */
+
+struct heatmap_run
+{
+  long x0, x1, y0;
+  int color;
+};
+
+static void
+heatmap_box (const double *window, double dx, double dy, const struct heatmap_run *run, long y1,
+             const int *lut, int *current)
+{
+  if (run->color != *current)
+    {
+      pl_fillcolor (lut[3 * run->color], lut[3 * run->color + 1], lut[3 * run->color + 2]);
+      *current = run->color;
+    }
+  pl_fbox (window[0] + run->x0 * dx, window[1] + run->y0 * dy,
+           window[0] + run->x1 * dx, window[1] + y1 * dy);
+}
+
+static VALUE
+heatmap (VALUE self, VALUE matrix, VALUE columns, VALUE colormap, VALUE range, VALUE window, VALUE merge)
+{
+  long count, width, height, colors, x, y, i, j, n_open, n_next, boxes = 0;
+  const double *data = get_doubles (matrix, &count);
+  double vmin, vmax, scale, win[4], dx, dy;
+  int mode, current = -1;
+  int *lut, *cells;
+  struct heatmap_run *open, *next, *tmp;
+  VALUE lut_v, cells_v, open_v, next_v;
+
+  get_handler (self);
+  width = NUM2LONG (columns);
+  if (width <= 0 || count % width != 0)
+    rb_raise(rb_eArgError, "Matrix size %ld is not a multiple of %ld columns!", count, width);
+  height = count / width;
+  Check_Type (colormap, T_ARRAY);
+  colors = RARRAY_LEN (colormap);
+  if (colors == 0)
+    rb_raise(rb_eArgError, "Colormap is empty!");
+  mode = FIX2INT (merge);
+
+  /* Resolve the colormap into a flat lookup table */
+  lut = ALLOCV_N (int, lut_v, 3 * colors);
+  for (i = 0; i < colors; i++)
+    {
+      VALUE rgb = rb_ary_entry (colormap, i);
+      Check_Type (rgb, T_ARRAY);
+      if (RARRAY_LEN (rgb) != 3)
+        rb_raise(rb_eArgError, "Colormap entries must be [red, green, blue] triples!");
+      for (j = 0; j < 3; j++)
+        lut[3 * i + j] = NUM2INT (rb_ary_entry (rgb, j));
+    }
+
+  /* Value range, NaN cells are left transparent */
+  if (NIL_P (range))
+    {
+      vmin = HUGE_VAL;
+      vmax = -HUGE_VAL;
+      for (i = 0; i < count; i++)
+        if (!isnan (data[i]))
+          {
+            if (data[i] < vmin) vmin = data[i];
+            if (data[i] > vmax) vmax = data[i];
+          }
+    }
+  else
+    {
+      Check_Type (range, T_ARRAY);
+      if (RARRAY_LEN (range) != 2)
+        rb_raise(rb_eArgError, "Range must be [min, max]!");
+      vmin = NUM2DBL (rb_ary_entry (range, 0));
+      vmax = NUM2DBL (rb_ary_entry (range, 1));
+    }
+  scale = vmax > vmin ? colors / (vmax - vmin) : 0.0;
+
+  if (NIL_P (window))
+    {
+      win[0] = 0.0;
+      win[1] = 0.0;
+      win[2] = width;
+      win[3] = height;
+    }
+  else
+    get_window (window, win);
+  dx = (win[2] - win[0]) / width;
+  dy = (win[3] - win[1]) / height;
+
+  /* Quantize all cells before touching the Plotter */
+  cells = ALLOCV_N (int, cells_v, count);
+  for (i = 0; i < count; i++)
+    {
+      if (isnan (data[i]))
+        cells[i] = -1;
+      else
+        {
+          /* Clamp before the cast, out of range values overflow a long */
+          double v = (data[i] - vmin) * scale;
+          cells[i] = v > 0 ? (v < colors ? (int)v : colors - 1) : 0;
+        }
+    }
+
+  open = ALLOCV_N (struct heatmap_run, open_v, width);
+  next = ALLOCV_N (struct heatmap_run, next_v, width);
+  n_open = 0;
+
+  pl_savestate ();
+  pl_pentype (0);
+  pl_filltype (1);
+  for (y = 0; y <= height; y++)
+    {
+      /* Collect the runs of equal color of row y */
+      n_next = 0;
+      if (y < height)
+        {
+          const int *row = cells + y * width;
+          for (x = 0; x < width; x = i)
+            {
+              for (i = x + 1; mode > 0 && i < width && row[i] == row[x]; i++)
+                ;
+              if (row[x] < 0)
+                continue;
+              next[n_next].x0 = x;
+              next[n_next].x1 = i;
+              next[n_next].y0 = y;
+              next[n_next].color = row[x];
+              n_next++;
+            }
+          if (mode < 2)
+            {
+              for (i = 0; i < n_next; i++, boxes++)
+                heatmap_box (win, dx, dy, &next[i], y + 1, lut, &current);
+              continue;
+            }
+        }
+
+      /* Extend the open rectangles continued by an identical run,
+         close the others */
+      for (i = 0, j = 0; i < n_open; i++)
+        {
+          while (j < n_next && next[j].x0 < open[i].x0)
+            j++;
+          if (j < n_next && next[j].x0 == open[i].x0 && next[j].x1 == open[i].x1
+              && next[j].color == open[i].color)
+            next[j].y0 = open[i].y0;
+          else
+            {
+              heatmap_box (win, dx, dy, &open[i], y, lut, &current);
+              boxes++;
+            }
+        }
+      tmp = open;
+      open = next;
+      next = tmp;
+      n_open = n_next;
+    }
+  pl_restorestate ();
+
+  ALLOCV_END (next_v);
+  ALLOCV_END (open_v);
+  ALLOCV_END (cells_v);
+  ALLOCV_END (lut_v);
+  return LONG2NUM (boxes);
+}
+
+struct contour_lines
+{
+  double *xy;
+  long *ends;
+  long points, lines, points_cap, lines_cap;
+  int failed, done;
+};
+
+struct contour_job
+{
+  const double *z;
+  long width, height;
+  const double *levels;
+  long n_levels;
+  const double *window;
+  struct contour_lines *sets;
+  int threads;
+  /* Set when the calling Ruby thread is interrupted, the levels not
+     done yet are traced again when it resumes */
+  volatile int cancel;
+};
+
+static void
+contour_push (struct contour_lines *set, double x, double y)
+{
+  if (set->points == set->points_cap)
+    {
+      long cap = set->points_cap ? 2 * set->points_cap : 256;
+      double *xy = realloc (set->xy, 2 * cap * sizeof (double));
+      if (xy == NULL)
+        {
+          set->failed = 1;
+          return;
+        }
+      set->xy = xy;
+      set->points_cap = cap;
+    }
+  set->xy[2 * set->points] = x;
+  set->xy[2 * set->points + 1] = y;
+  set->points++;
+}
+
+static void
+contour_end_line (struct contour_lines *set)
+{
+  if (set->lines == set->lines_cap)
+    {
+      long cap = set->lines_cap ? 2 * set->lines_cap : 64;
+      long *ends = realloc (set->ends, cap * sizeof (long));
+      if (ends == NULL)
+        {
+          set->failed = 1;
+          return;
+        }
+      set->ends = ends;
+      set->lines_cap = cap;
+    }
+  set->ends[set->lines++] = set->points;
+}
+
+/* Grid edges are numbered with the horizontal ones (i,j)-(i+1,j)
+   first, followed by the vertical ones (i,j)-(i,j+1). */
+
+static void
+contour_edge_point (const struct contour_job *job, long e, double level, double *x, double *y)
+{
+  long w = job->width, horizontal = job->height * (w - 1);
+  long i, j, a, b;
+  double t, dx = (job->window[2] - job->window[0]) / (w - 1);
+  double dy = (job->window[3] - job->window[1]) / (job->height - 1);
+  if (e < horizontal)
+    {
+      i = e % (w - 1);
+      j = e / (w - 1);
+      a = j * w + i;
+      b = a + 1;
+      t = (level - job->z[a]) / (job->z[b] - job->z[a]);
+      *x = job->window[0] + (i + t) * dx;
+      *y = job->window[1] + j * dy;
+    }
+  else
+    {
+      i = (e - horizontal) % w;
+      j = (e - horizontal) / w;
+      a = j * w + i;
+      b = a + w;
+      t = (level - job->z[a]) / (job->z[b] - job->z[a]);
+      *x = job->window[0] + i * dx;
+      *y = job->window[1] + (j + t) * dy;
+    }
+}
+
+static void
+contour_link (long *links, long a, long b)
+{
+  links[2 * a + (links[2 * a] >= 0)] = b;
+  links[2 * b + (links[2 * b] >= 0)] = a;
+}
+
+static void
+contour_level (const struct contour_job *job, double level, struct contour_lines *set)
+{
+  long w = job->width, h = job->height;
+  long horizontal = h * (w - 1), edges = horizontal + (h - 1) * w;
+  long i, j, e, prev, next;
+  long *links = malloc (2 * edges * sizeof (long));
+  char *visited = calloc (edges, 1);
+  int pass;
+
+  if (links == NULL || visited == NULL)
+    {
+      free (links);
+      free (visited);
+      set->failed = 1;
+      return;
+    }
+  for (e = 0; e < 2 * edges; e++)
+    links[e] = -1;
+
+  /* Marching squares: link the crossed edges of every cell */
+  for (j = 0; j < h - 1 && !job->cancel; j++)
+    for (i = 0; i < w - 1; i++)
+      {
+        const double *z = job->z + j * w + i;
+        long bottom = j * (w - 1) + i, top = bottom + (w - 1);
+        long left = horizontal + j * w + i, right = left + 1;
+        int mask;
+        if (isnan (z[0]) || isnan (z[1]) || isnan (z[w]) || isnan (z[w + 1]))
+          continue;
+        mask = (z[0] >= level) | (z[1] >= level) << 1 | (z[w + 1] >= level) << 2 | (z[w] >= level) << 3;
+        switch (mask)
+          {
+          case 1: case 14: contour_link (links, left, bottom); break;
+          case 2: case 13: contour_link (links, bottom, right); break;
+          case 3: case 12: contour_link (links, left, right); break;
+          case 4: case 11: contour_link (links, right, top); break;
+          case 6: case 9: contour_link (links, bottom, top); break;
+          case 7: case 8: contour_link (links, left, top); break;
+          case 5: case 10:
+            /* Saddle, disambiguated by the value at the cell center */
+            if (((z[0] + z[1] + z[w] + z[w + 1]) / 4 >= level) == (mask == 5))
+              {
+                contour_link (links, bottom, right);
+                contour_link (links, left, top);
+              }
+            else
+              {
+                contour_link (links, left, bottom);
+                contour_link (links, right, top);
+              }
+            break;
+          }
+      }
+  if (job->cancel)
+    {
+      free (links);
+      free (visited);
+      return;
+    }
+
+  /* Stitch the segments into polylines: open chains start from an
+     edge with a single link, the first pass; closed rings the second */
+  for (pass = 0; pass < 2 && !set->failed; pass++)
+    for (e = 0; e < edges && !set->failed; e++)
+      {
+        double x, y;
+        if (visited[e] || links[2 * e] < 0 || (pass == 0 && links[2 * e + 1] >= 0))
+          continue;
+        prev = -1;
+        next = e;
+        while (next >= 0 && !visited[next])
+          {
+            visited[next] = 1;
+            contour_edge_point (job, next, level, &x, &y);
+            contour_push (set, x, y);
+            j = links[2 * next] != prev ? links[2 * next] : links[2 * next + 1];
+            prev = next;
+            next = j;
+          }
+        if (next == e)
+          {
+            contour_edge_point (job, e, level, &x, &y);
+            contour_push (set, x, y);
+          }
+        contour_end_line (set);
+      }
+  free (links);
+  free (visited);
+  set->done = 1;
+}
+
+struct contour_worker_arg
+{
+  const struct contour_job *job;
+  int index;
+};
+
+static void *
+contour_worker (void *data)
+{
+  struct contour_worker_arg *arg = data;
+  long l;
+  for (l = arg->index; l < arg->job->n_levels && !arg->job->cancel; l += arg->job->threads)
+    if (!arg->job->sets[l].done)
+      contour_level (arg->job, arg->job->levels[l], &arg->job->sets[l]);
+  return NULL;
+}
+
+/* Upper bound of the tracing threads */
+#define CONTOUR_MAX_THREADS 64
+
+static void *
+contour_compute (void *data)
+{
+  struct contour_job *job = data;
+  struct contour_worker_arg args[CONTOUR_MAX_THREADS];
+  int t;
+  memset (args, 0, sizeof (args));
+  for (t = 0; t < job->threads; t++)
+    {
+      args[t].job = job;
+      args[t].index = t;
+    }
+#ifdef HAVE_PTHREAD_H
+  pthread_t threads[CONTOUR_MAX_THREADS];
+  int started[CONTOUR_MAX_THREADS];
+  for (t = 1; t < job->threads; t++)
+    started[t] = pthread_create (&threads[t], NULL, contour_worker, &args[t]) == 0;
+  contour_worker (&args[0]);
+  for (t = 1; t < job->threads; t++)
+    if (started[t])
+      pthread_join (threads[t], NULL);
+    else
+      contour_worker (&args[t]);
+#else
+  for (t = 0; t < job->threads; t++)
+    contour_worker (&args[t]);
+#endif
+  return NULL;
+}
+
+static void
+contour_cancel (void *data)
+{
+  ((struct contour_job *)data)->cancel = 1;
+}
+
+static VALUE
+contour_check_ints (VALUE unused)
+{
+  rb_thread_check_ints ();
+  return Qnil;
+}
+
+static void
+contour_free_sets (struct contour_job *job)
+{
+  long l;
+  for (l = 0; l < job->n_levels; l++)
+    {
+      free (job->sets[l].xy);
+      free (job->sets[l].ends);
+    }
+}
+
+static VALUE
+contour (VALUE self, VALUE grid, VALUE columns, VALUE levels, VALUE window, VALUE threads)
+{
+  struct contour_job job;
+  long count, l, k, p, lines = 0;
+  double win[4];
+  int failed = 0;
+  VALUE levels_v, sets_v;
+
+  get_handler (self);
+  StringValue (grid);
+  job.z = get_doubles (grid, &count);
+  job.width = NUM2LONG (columns);
+  if (job.width < 2 || count % job.width != 0 || count / job.width < 2)
+    rb_raise(rb_eArgError, "Grid of %ld values is not a %ld columns grid of at least 2 rows!", count, job.width);
+  job.height = count / job.width;
+  Check_Type (levels, T_ARRAY);
+  job.n_levels = RARRAY_LEN (levels);
+  job.levels = ALLOCV_N (double, levels_v, job.n_levels);
+  for (l = 0; l < job.n_levels; l++)
+    ((double *)job.levels)[l] = NUM2DBL (rb_ary_entry (levels, l));
+  if (NIL_P (window))
+    {
+      win[0] = 0.0;
+      win[1] = 0.0;
+      win[2] = job.width - 1;
+      win[3] = job.height - 1;
+    }
+  else
+    get_window (window, win);
+  job.window = win;
+  job.threads = NUM2INT (threads);
+  job.cancel = 0;
+  if (job.threads > job.n_levels)
+    job.threads = (int)job.n_levels;
+  if (job.threads > CONTOUR_MAX_THREADS)
+    job.threads = CONTOUR_MAX_THREADS;
+  if (job.threads < 1)
+    job.threads = 1;
+  job.sets = ALLOCV_N (struct contour_lines, sets_v, job.n_levels);
+  memset (job.sets, 0, job.n_levels * sizeof (struct contour_lines));
+
+  /* The grid is only read, so the levels may be traced without the
+     GVL, with the grid String locked against changes from other
+     threads, while the Plotter itself is fed from this thread only.
+     An interrupt stops the tracing threads so that Ruby can handle
+     it, e.g. run a trap handler; the tracing then resumes, unless
+     handling it raised. */
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_str_locktmp (grid);
+  do
+    {
+      job.cancel = 0;
+      rb_thread_call_without_gvl (contour_compute, &job, contour_cancel, &job);
+      if (job.cancel)
+        {
+          int state = 0;
+          rb_protect (contour_check_ints, Qnil, &state);
+          if (state)
+            {
+              rb_str_unlocktmp (grid);
+              contour_free_sets (&job);
+              ALLOCV_END (sets_v);
+              ALLOCV_END (levels_v);
+              rb_jump_tag (state);
+            }
+        }
+    }
+  while (job.cancel);
+  rb_str_unlocktmp (grid);
+#else
+  contour_compute (&job);
+#endif
+
+  for (l = 0; l < job.n_levels; l++)
+    {
+      const struct contour_lines *set = &job.sets[l];
+      failed |= set->failed;
+      for (k = 0, p = 0; !failed && k < set->lines; p = set->ends[k++])
+        {
+          if (set->ends[k] - p < 2)
+            continue;
+          pl_fmove (set->xy[2 * p], set->xy[2 * p + 1]);
+          for (p++; p < set->ends[k]; p++)
+            pl_fcont (set->xy[2 * p], set->xy[2 * p + 1]);
+          pl_endpath ();
+          lines++;
+        }
+      free (set->xy);
+      free (set->ends);
+    }
+  ALLOCV_END (sets_v);
+  ALLOCV_END (levels_v);
+  if (failed)
+    rb_raise(rb_eNoMemError, "Couldn't allocate contour lines!");
+  return LONG2NUM (lines);
+}
+
+static VALUE
+labels (VALUE self, VALUE xs, VALUE ys, VALUE strings, VALUE horiz_justify, VALUE vert_justify, VALUE angles)
+{
+  long n, count, i, n_angles = 0;
+  const double *x = get_doubles (xs, &n);
+  const double *y = get_doubles (ys, &count);
+  const double *angle = NULL;
+  const char *h, *v;
+  long n_h, n_v;
+  double current = 0.0;
+  int has_current = 0;
+
+  get_handler (self);
+  Check_Type (strings, T_ARRAY);
+  if (count != n || RARRAY_LEN (strings) != n)
+    rb_raise(rb_eArgError, "Coordinates and strings must have the same length!");
+  StringValue (horiz_justify);
+  StringValue (vert_justify);
+  h = RSTRING_PTR (horiz_justify);
+  v = RSTRING_PTR (vert_justify);
+  n_h = RSTRING_LEN (horiz_justify);
+  n_v = RSTRING_LEN (vert_justify);
+  if ((n_h != 1 && n_h != n) || (n_v != 1 && n_v != n))
+    rb_raise(rb_eArgError, "Justifications must be one per label, or one for all!");
+  if (!NIL_P (angles))
+    {
+      if (TYPE (angles) == T_STRING)
+        {
+          angle = get_doubles (angles, &n_angles);
+          if (n_angles != n)
+            rb_raise(rb_eArgError, "Angles must be one per label!");
+        }
+      else
+        pl_ftextangle (NUM2DBL (angles));
+    }
+  for (i = 0; i < n; i++)
+    StringValueCStr (RARRAY_PTR (strings)[i]);
+
+  /* The text angle only changes between labels of different angle */
+  for (i = 0; i < n; i++)
+    {
+      if (angle != NULL && (!has_current || angle[i] != current))
+        {
+          pl_ftextangle (angle[i]);
+          current = angle[i];
+          has_current = 1;
+        }
+      pl_fmove (x[i], y[i]);
+      pl_alabel ((unsigned char)h[n_h == 1 ? 0 : i], (unsigned char)v[n_v == 1 ? 0 : i],
+                 RSTRING_PTR (RARRAY_PTR (strings)[i]));
+    }
+  return LONG2NUM (n);
+}
+
+static VALUE
+polyline (VALUE self, VALUE xs, VALUE ys, VALUE start)
+{
+  long n, count, i, from = NUM2LONG (start);
+  const double *x = get_doubles (xs, &n);
+  const double *y = get_doubles (ys, &count);
+
+  get_handler (self);
+  if (count != n)
+    rb_raise(rb_eArgError, "Coordinates must have the same length!");
+  if (from < 0 || from >= n)
+    return INT2FIX (0);
+  pl_fmove (x[from], y[from]);
+  for (i = from + 1; i < n; i++)
+    pl_fcont (x[i], y[i]);
+  pl_endpath ();
+  return LONG2NUM (n - from - 1);
+}
+
+/* File streaming */
+
+enum file_format
+{
+  FILE_F64LE, FILE_F32LE, FILE_CSV
+};
+
+/* Bytes read at once, and the longest CSV line */
+#define FILE_CHUNK 65536
+/* Vertices after which a polyline path is ended and continued */
+#define FILE_PATH_POINTS 4096
+
+struct file_sink
+{
+  int marker;
+  double marker_size;
+  long points;
+  long segment;
+};
+
+/* Draws the next record, either as a marker or as the next vertex of
+   the polyline. NaN coordinates break the polyline, and long
+   polylines are split so that libplot does not store them whole */
+static void
+file_sink_point (struct file_sink *sink, double x, double y)
+{
+  if (isnan (x) || isnan (y))
+    {
+      if (sink->segment > 0)
+        pl_endpath ();
+      sink->segment = 0;
+      return;
+    }
+  sink->points++;
+  if (sink->marker >= 0)
+    {
+      pl_fmarker (x, y, sink->marker, sink->marker_size);
+      return;
+    }
+  if (sink->segment == 0)
+    pl_fmove (x, y);
+  else
+    pl_fcont (x, y);
+  if (++sink->segment == FILE_PATH_POINTS)
+    {
+      pl_endpath ();
+      pl_fmove (x, y);
+      sink->segment = 1;
+    }
+}
+
+static double
+file_value (const unsigned char *p, int format)
+{
+  unsigned char b[sizeof (double)];
+  int size = format == FILE_F64LE ? 8 : 4, i;
+  double d;
+  float f;
+  for (i = 0; i < size; i++)
+#ifdef WORDS_BIGENDIAN
+    b[i] = p[size - 1 - i];
+#else
+    b[i] = p[i];
+#endif
+  if (format == FILE_F64LE)
+    {
+      memcpy (&d, b, sizeof (d));
+      return d;
+    }
+  memcpy (&f, b, sizeof (f));
+  return f;
+}
+
+static void
+file_records (struct file_sink *sink, const unsigned char *p, long count, int format, long fields, long x_col, long y_col, long *index)
+{
+  long size = (format == FILE_F64LE ? 8 : 4) * fields, i;
+  for (i = 0; i < count; i++, p += size, (*index)++)
+    file_sink_point (sink, x_col < 0 ? (double)*index : file_value (p + x_col * (size / fields), format),
+                     file_value (p + y_col * (size / fields), format));
+}
+
+/* Returns -1 if a record doesn't fit in memory */
+static int
+file_binary (struct file_sink *sink, FILE *file, int format, long fields, long x_col, long y_col)
+{
+  unsigned char chunk[FILE_CHUNK], *buffer = chunk;
+  long size = (format == FILE_F64LE ? 8 : 4) * fields, index = 0, capacity = FILE_CHUNK;
+  size_t len = 0, n;
+
+#ifdef HAVE_MMAP
+  struct stat st;
+  if (fstat (fileno (file), &st) == 0 && S_ISREG (st.st_mode) && st.st_size >= size)
+    {
+      void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno (file), 0);
+      if (map != MAP_FAILED)
+        {
+#ifdef MADV_SEQUENTIAL
+          madvise (map, st.st_size, MADV_SEQUENTIAL);
+#endif
+          file_records (sink, map, st.st_size / size, format, fields, x_col, y_col, &index);
+          munmap (map, st.st_size);
+          return 0;
+        }
+    }
+#endif
+  /* Not mappable: read whole records chunk by chunk, records larger
+     than a chunk one at a time */
+  if (size > FILE_CHUNK)
+    {
+      capacity = size;
+      if ((buffer = malloc (capacity)) == NULL)
+        return -1;
+    }
+  while ((n = fread (buffer + len, 1, capacity / size * size - len, file)) > 0)
+    {
+      len += n;
+      file_records (sink, buffer, len / size, format, fields, x_col, y_col, &index);
+      memmove (buffer, buffer + len / size * size, len % size);
+      len %= size;
+    }
+  if (buffer != chunk)
+    free (buffer);
+  return 0;
+}
+
+/* Reads the columns x_col and y_col of a CSV line, returns 0 if the
+   line is blank, or one of them is missing or not a number, as in
+   headers. Empty values are read as NaN, missing samples. */
+static int
+file_csv_line (char *line, long x_col, long y_col, double *x, double *y)
+{
+  long col;
+  int found = x_col < 0;
+  char *end;
+  if (line[strspn (line, " \t\r")] == '\0')
+    return 0;
+  for (col = 0; line != NULL; col++)
+    {
+      if (col == x_col || col == y_col)
+        {
+          double value;
+          end = line + strspn (line, " \t\r");
+          if (*end == ',' || *end == '\0')
+            value = NAN;
+          else
+            {
+              value = strtod (line, &end);
+              if (end == line)
+                return 0;
+            }
+          while (*end == ' ' || *end == '\t' || *end == '\r')
+            end++;
+          if (*end != ',' && *end != '\0')
+            return 0;
+          if (col == x_col)
+            *x = value, found++;
+          if (col == y_col)
+            *y = value, found++;
+        }
+      line = strchr (line, ',');
+      if (line != NULL)
+        line++;
+    }
+  return found == 2;
+}
+
+static void
+file_csv_record (struct file_sink *sink, char *line, long x_col, long y_col, long *index)
+{
+  double x, y;
+  if (file_csv_line (line, x_col, y_col, &x, &y))
+    file_sink_point (sink, x_col < 0 ? (double)(*index)++ : x, y);
+}
+
+static int
+file_csv (struct file_sink *sink, FILE *file, long x_col, long y_col)
+{
+  char buffer[FILE_CHUNK + 1], *start, *end;
+  size_t len = 0, n;
+  long index = 0;
+
+  do
+    {
+      n = fread (buffer + len, 1, FILE_CHUNK - len, file);
+      len += n;
+      buffer[len] = '\0';
+      for (start = buffer; (end = memchr (start, '\n', buffer + len - start)) != NULL; start = end + 1)
+        {
+          *end = '\0';
+          file_csv_record (sink, start, x_col, y_col, &index);
+        }
+      len -= start - buffer;
+      if (len == FILE_CHUNK)
+        return -1;
+      /* The last line may not end with a newline */
+      if (n == 0 && len > 0)
+        file_csv_record (sink, start, x_col, y_col, &index);
+      memmove (buffer, start, len);
+    }
+  while (n > 0);
+  return 0;
+}
+
+static VALUE
+plot_file (VALUE self, VALUE path, VALUE format, VALUE fields, VALUE x_col, VALUE y_col, VALUE marker, VALUE marker_size)
+{
+  struct file_sink sink = { NIL_P (marker) ? -1 : NUM2INT (marker), NUM2DBL (marker_size), 0, 0 };
+  long nfields = NUM2LONG (fields), x = NUM2LONG (x_col), y = NUM2LONG (y_col);
+  int fmt = NUM2INT (format), status = 0;
+  FILE *file;
+
+  get_handler (self);
+  if (y < 0 || x < -1)
+    rb_raise(rb_eArgError, "Columns must not be negative!");
+  if (fmt != FILE_CSV && (x >= nfields || y >= nfields))
+    rb_raise(rb_eArgError, "Columns must be less than the %ld fields of a record!", nfields);
+  file = fopen (StringValueCStr (path), "rb");
+  if (file == NULL)
+    rb_raise(operation_plotter_error, "Couldn't open %s: %s!", StringValuePtr (path), strerror (errno));
+  if (fmt == FILE_CSV)
+    status = file_csv (&sink, file, x, y);
+  else if (file_binary (&sink, file, fmt, nfields, x, y) < 0)
+    status = -2;
+  if (sink.segment > 0)
+    pl_endpath ();
+  fclose (file);
+  if (status == -1)
+    rb_raise(operation_plotter_error, "CSV line longer than %d bytes in %s!", FILE_CHUNK, StringValuePtr (path));
+  if (status == -2)
+    rb_raise(rb_eNoMemError, "Couldn't allocate a record of %ld fields of %s!", nfields, StringValuePtr (path));
+  return LONG2NUM (sink.points);
+}
+
+/* Offsets into the next level of a GeoArrow-like layout, as packed
+   native 32-bit integers, increasing from 0 up to limit */
+static const int32_t *
+get_offsets (VALUE buffer, long *count, long limit, const char *name)
+{
+  const int32_t *p;
+  long i;
+  StringValue (buffer);
+  if (RSTRING_LEN (buffer) == 0 || RSTRING_LEN (buffer) % sizeof (int32_t) != 0)
+    rb_raise(rb_eArgError, "%s must be packed 32-bit integers!", name);
+  *count = RSTRING_LEN (buffer) / sizeof (int32_t);
+  p = (const int32_t *)RSTRING_PTR (buffer);
+  for (i = 0; i < *count; i++)
+    if (p[i] < 0 || p[i] > limit || (i > 0 && p[i] < p[i - 1]))
+      rb_raise(rb_eArgError, "%s must increase within 0..%ld!", name, limit);
+  return p;
+}
+
+static VALUE
+polygons (VALUE self, VALUE coords, VALUE ring_offsets, VALUE polygon_offsets, VALUE colors, VALUE fill_rule)
+{
+  long n, n_rings, n_polygons, p, r, v, start, end, drawn = 0;
+  const double *xy = get_doubles (coords, &n);
+  const int32_t *rings, *polys;
+  const uint16_t *rgb = NULL;
+  const char *rule = NIL_P (fill_rule) ? NULL : StringValueCStr (fill_rule);
+  long current[3] = { -1, -1, -1 };
+
+  get_handler (self);
+  if (n % 2 != 0)
+    rb_raise(rb_eArgError, "Coordinates must be packed (x, y) pairs!");
+  rings = get_offsets (ring_offsets, &n_rings, n / 2, "Ring offsets");
+  polys = get_offsets (polygon_offsets, &n_polygons, n_rings - 1, "Polygon offsets");
+  n_polygons--;
+  if (!NIL_P (colors))
+    {
+      StringValue (colors);
+      if (RSTRING_LEN (colors) != n_polygons * 3 * (long)sizeof (uint16_t))
+        rb_raise(rb_eArgError, "Expected %ld packed 16-bit [red, green, blue] fill colors!", n_polygons);
+      rgb = (const uint16_t *)RSTRING_PTR (colors);
+    }
+
+  pl_savestate ();
+  pl_filltype (1);
+  if (rule != NULL)
+    pl_fillmod (rule);
+  for (p = 0; p < n_polygons; p++)
+    {
+      if (polys[p] == polys[p + 1])
+        continue;
+      /* Fill color only changes between polygons of different colors */
+      if (rgb != NULL && (rgb[3 * p] != current[0] || rgb[3 * p + 1] != current[1] || rgb[3 * p + 2] != current[2]))
+        {
+          current[0] = rgb[3 * p];
+          current[1] = rgb[3 * p + 1];
+          current[2] = rgb[3 * p + 2];
+          pl_fillcolor (current[0], current[1], current[2]);
+        }
+      /* Rings are the simple paths of one compound path */
+      for (r = polys[p]; r < polys[p + 1]; r++)
+        {
+          start = rings[r];
+          end = rings[r + 1];
+          if (end - start > 1 && xy[2 * start] == xy[2 * (end - 1)] && xy[2 * start + 1] == xy[2 * (end - 1) + 1])
+            end--;
+          if (end - start < 2)
+            continue;
+          pl_fmove (xy[2 * start], xy[2 * start + 1]);
+          for (v = start + 1; v < end; v++)
+            pl_fcont (xy[2 * v], xy[2 * v + 1]);
+          pl_closepath ();
+          pl_endsubpath ();
+        }
+      pl_endpath ();
+      drawn++;
+    }
+  pl_restorestate ();
+  return LONG2NUM (drawn);
+}
+
+/* Tiled rendering */
+
+struct pnm_tile
+{
+  FILE *file;
+  int magic, maxval;
+  long width, height;
+  unsigned char *row;
+};
+
+static int
+pnm_header_int (FILE *file, long *value)
+{
+  int c;
+  for (;;)
+    {
+      c = fgetc (file);
+      if (c == '#')
+        while (c != '\n' && c != EOF)
+          c = fgetc (file);
+      else if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+        break;
+    }
+  if (c < '0' || c > '9')
+    return -1;
+  for (*value = 0; c >= '0' && c <= '9'; c = fgetc (file))
+    *value = *value * 10 + (c - '0');
+  return 0;
+}
+
+static int
+pnm_open_tile (struct pnm_tile *tile, const char *path)
+{
+  long maxval = 1;
+  tile->file = fopen (path, "rb");
+  if (tile->file == NULL)
+    return -1;
+  if (fgetc (tile->file) != 'P')
+    return -1;
+  tile->magic = fgetc (tile->file) - '0';
+  if (tile->magic < 4 || tile->magic > 6)
+    return -1;
+  if (pnm_header_int (tile->file, &tile->width) < 0 || pnm_header_int (tile->file, &tile->height) < 0)
+    return -1;
+  if (tile->magic != 4 && (pnm_header_int (tile->file, &maxval) < 0 || maxval < 1 || maxval > 65535))
+    return -1;
+  tile->maxval = (int)maxval;
+  return 0;
+}
+
+/* Reads the next row of a tile and expands it to 8-bit RGB into rgb */
+static int
+pnm_read_row (struct pnm_tile *tile, unsigned char *rgb)
+{
+  long x, size;
+  int depth = tile->maxval > 255 ? 2 : 1;
+  if (tile->magic == 4)
+    size = (tile->width + 7) / 8;
+  else
+    size = tile->width * depth * (tile->magic == 6 ? 3 : 1);
+  if ((long)fread (tile->row, 1, size, tile->file) != size)
+    return -1;
+  for (x = 0; x < tile->width; x++)
+    {
+      int c;
+      if (tile->magic == 4)
+        {
+          unsigned char v = (tile->row[x / 8] >> (7 - x % 8)) & 1 ? 0 : 255;
+          rgb[3 * x] = rgb[3 * x + 1] = rgb[3 * x + 2] = v;
+          continue;
+        }
+      for (c = 0; c < 3; c++)
+        {
+          long i = tile->magic == 6 ? 3 * x + c : x;
+          long v = depth == 2 ? tile->row[2 * i] << 8 | tile->row[2 * i + 1] : tile->row[i];
+          rgb[3 * x + c] = (unsigned char)(v * 255 / tile->maxval);
+        }
+    }
+  return 0;
+}
+
+static VALUE
+stitch_pnm (VALUE self, VALUE out_path, VALUE tile_paths)
+{
+  long n, i, y, width = 0, height = 0;
+  struct pnm_tile *tiles;
+  unsigned char *rgb;
+  FILE *out;
+  VALUE tiles_v, rgb_v;
+  int failed = 0;
+
+  Check_Type (tile_paths, T_ARRAY);
+  n = RARRAY_LEN (tile_paths);
+  for (i = 0; i < n; i++)
+    StringValue (RARRAY_PTR (tile_paths)[i]);
+  /* Pending output of the tile Plotters must reach their files */
+  fflush (NULL);
+
+  tiles = ALLOCV_N (struct pnm_tile, tiles_v, n);
+  memset (tiles, 0, n * sizeof (struct pnm_tile));
+  for (i = 0; i < n && !failed; i++)
+    {
+      failed = pnm_open_tile (&tiles[i], RSTRING_PTR (RARRAY_PTR (tile_paths)[i])) < 0
+        || tiles[i].height != tiles[0].height;
+      if (!failed)
+        {
+          tiles[i].row = xmalloc (6 * tiles[i].width);
+          width += tiles[i].width;
+        }
+    }
+  out = failed ? NULL : fopen (StringValuePtr (out_path), "ab");
+  if (out != NULL)
+    {
+      /* One row of the band at a time, so only a row per tile is kept
+         in memory */
+      height = tiles[0].height;
+      rgb = ALLOCV_N (unsigned char, rgb_v, 3 * width);
+      for (y = 0; y < height && !failed; y++)
+        {
+          long x = 0;
+          for (i = 0; i < n && !failed; x += tiles[i++].width)
+            failed = pnm_read_row (&tiles[i], rgb + 3 * x) < 0;
+          if (!failed)
+            failed = fwrite (rgb, 1, 3 * width, out) != (size_t)(3 * width);
+        }
+      ALLOCV_END (rgb_v);
+      failed |= fclose (out) != 0;
+    }
+  else
+    failed = 1;
+  for (i = 0; i < n; i++)
+    {
+      if (tiles[i].file != NULL)
+        fclose (tiles[i].file);
+      xfree (tiles[i].row);
+    }
+  ALLOCV_END (tiles_v);
+  if (failed)
+    rb_raise(operation_plotter_error, "Couldn't stitch PNM tiles into %s!", StringValuePtr (out_path));
+  return LONG2NUM (height);
+}
+
+/* Scene */
+
+enum scene_type
+{
+  SCENE_LINE, SCENE_BOX, SCENE_CIRCLE, SCENE_ELLIPSE, SCENE_POINT, SCENE_MARKER, SCENE_POLYLINE
+};
+
+struct scene_item
+{
+  int type;
+  double c[5];
+  double bbox[4];
+  long long pen, fill;
+};
+
+struct scene
+{
+  struct scene_item *items;
+  long n_items, items_cap;
+  double *xy;
+  long n_xy, xy_cap;
+  long long pen, fill;
+  double bbox[4];
+  /* Uniform grid index, cell_start has cells_x * cells_y + 1 entries */
+  long cells_x, cells_y;
+  long *cell_start, *cell_items;
+  /* SHA-256 of the content, kept until the scene is changed */
+  unsigned char digest[32];
+  int digested;
+};
+
+static void
+scene_drop_index (struct scene *scene)
+{
+  xfree (scene->cell_start);
+  xfree (scene->cell_items);
+  scene->cell_start = scene->cell_items = NULL;
+  scene->cells_x = scene->cells_y = 0;
+}
+
+static void
+scene_free (void *data)
+{
+  struct scene *scene = data;
+  scene_drop_index (scene);
+  xfree (scene->items);
+  xfree (scene->xy);
+  xfree (scene);
+}
+
+static size_t
+scene_memsize (const void *data)
+{
+  const struct scene *scene = data;
+  size_t size = sizeof (struct scene) + scene->items_cap * sizeof (struct scene_item) + scene->xy_cap * sizeof (double);
+  if (scene->cell_start != NULL)
+    size += (scene->cells_x * scene->cells_y + 1 + scene->cell_start[scene->cells_x * scene->cells_y]) * sizeof (long);
+  return size;
+}
+
+static const rb_data_type_t scene_data_type = {
+  "Rplot::Scene",
+  { NULL, scene_free, scene_memsize, },
+  NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+scene_alloc (VALUE klass)
+{
+  struct scene *scene;
+  VALUE obj = TypedData_Make_Struct (klass, struct scene, &scene_data_type, scene);
+  scene->pen = scene->fill = -1;
+  scene->bbox[0] = scene->bbox[1] = HUGE_VAL;
+  scene->bbox[2] = scene->bbox[3] = -HUGE_VAL;
+  return obj;
+}
+
+static struct scene *
+get_scene (VALUE obj)
+{
+  struct scene *scene;
+  TypedData_Get_Struct (obj, struct scene, &scene_data_type, scene);
+  return scene;
+}
+
+/* The scene of obj, which is about to be changed */
+static struct scene *
+get_mutable_scene (VALUE obj)
+{
+  struct scene *scene;
+  rb_check_frozen (obj);
+  scene = get_scene (obj);
+  scene->digested = 0;
+  return scene;
+}
+
+/* Copies items and coordinates, the index is rebuilt when drawn */
+static VALUE
+scene_init_copy (VALUE self, VALUE orig)
+{
+  struct scene *scene, *src;
+  if (self == orig)
+    return self;
+  scene = get_mutable_scene (self);
+  src = get_scene (orig);
+  scene_drop_index (scene);
+  if (src->n_items > scene->items_cap)
+    {
+      scene->items_cap = src->n_items;
+      REALLOC_N (scene->items, struct scene_item, scene->items_cap);
+    }
+  MEMCPY (scene->items, src->items, struct scene_item, src->n_items);
+  scene->n_items = src->n_items;
+  if (src->n_xy > scene->xy_cap)
+    {
+      scene->xy_cap = src->n_xy;
+      REALLOC_N (scene->xy, double, scene->xy_cap);
+    }
+  MEMCPY (scene->xy, src->xy, double, src->n_xy);
+  scene->n_xy = src->n_xy;
+  scene->pen = src->pen;
+  scene->fill = src->fill;
+  memcpy (scene->bbox, src->bbox, sizeof (scene->bbox));
+  /* The index and digest too, so that copies draw without rebuilding */
+  if (src->cell_start != NULL)
+    {
+      long cells = src->cells_x * src->cells_y;
+      scene->cells_x = src->cells_x;
+      scene->cells_y = src->cells_y;
+      scene->cell_start = ALLOC_N (long, cells + 1);
+      MEMCPY (scene->cell_start, src->cell_start, long, cells + 1);
+      scene->cell_items = ALLOC_N (long, src->cell_start[cells] > 0 ? src->cell_start[cells] : 1);
+      MEMCPY (scene->cell_items, src->cell_items, long, src->cell_start[cells]);
+    }
+  memcpy (scene->digest, src->digest, sizeof (scene->digest));
+  scene->digested = src->digested;
+  return self;
+}
+
+static long long
+scene_color (VALUE rgb)
+{
+  if (NIL_P (rgb))
+    return -1;
+  Check_Type (rgb, T_ARRAY);
+  return (long long)(NUM2INT (rb_ary_entry (rgb, 0)) & 0xffff) << 32
+    | (long long)(NUM2INT (rb_ary_entry (rgb, 1)) & 0xffff) << 16
+    | (NUM2INT (rb_ary_entry (rgb, 2)) & 0xffff);
+}
+
+static struct scene_item *
+scene_push (struct scene *scene, int type, double x0, double y0, double x1, double y1)
+{
+  struct scene_item *item;
+  if (scene->n_items == scene->items_cap)
+    {
+      scene->items_cap = scene->items_cap ? 2 * scene->items_cap : 64;
+      REALLOC_N (scene->items, struct scene_item, scene->items_cap);
+    }
+  scene_drop_index (scene);
+  item = &scene->items[scene->n_items++];
+  item->type = type;
+  item->pen = scene->pen;
+  item->fill = scene->fill;
+  item->bbox[0] = x0 < x1 ? x0 : x1;
+  item->bbox[1] = y0 < y1 ? y0 : y1;
+  item->bbox[2] = x0 < x1 ? x1 : x0;
+  item->bbox[3] = y0 < y1 ? y1 : y0;
+  if (item->bbox[0] < scene->bbox[0]) scene->bbox[0] = item->bbox[0];
+  if (item->bbox[1] < scene->bbox[1]) scene->bbox[1] = item->bbox[1];
+  if (item->bbox[2] > scene->bbox[2]) scene->bbox[2] = item->bbox[2];
+  if (item->bbox[3] > scene->bbox[3]) scene->bbox[3] = item->bbox[3];
+  return item;
+}
+
+static VALUE
+scene_colors (VALUE self, VALUE pen, VALUE fill)
+{
+  struct scene *scene = get_mutable_scene (self);
+  scene->pen = scene_color (pen);
+  scene->fill = scene_color (fill);
+  return self;
+}
+
+static VALUE
+scene_add (VALUE self, VALUE type, VALUE coords)
+{
+  struct scene *scene = get_mutable_scene (self);
+  struct scene_item *item;
+  double c[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 }, r;
+  int t = NUM2INT (type), i;
+  Check_Type (coords, T_ARRAY);
+  for (i = 0; i < 5 && i < RARRAY_LEN (coords); i++)
+    c[i] = NUM2DBL (rb_ary_entry (coords, i));
+  switch (t)
+    {
+    case SCENE_LINE:
+    case SCENE_BOX:
+      item = scene_push (scene, t, c[0], c[1], c[2], c[3]);
+      break;
+    case SCENE_CIRCLE:
+      item = scene_push (scene, t, c[0] - c[2], c[1] - c[2], c[0] + c[2], c[1] + c[2]);
+      break;
+    case SCENE_ELLIPSE:
+      r = c[2] > c[3] ? c[2] : c[3];
+      item = scene_push (scene, t, c[0] - r, c[1] - r, c[0] + r, c[1] + r);
+      break;
+    case SCENE_POINT:
+      item = scene_push (scene, t, c[0], c[1], c[0], c[1]);
+      break;
+    case SCENE_MARKER:
+      item = scene_push (scene, t, c[0] - c[3] / 2, c[1] - c[3] / 2, c[0] + c[3] / 2, c[1] + c[3] / 2);
+      break;
+    default:
+      rb_raise(rb_eArgError, "Unknown scene item type %d!", t);
+    }
+  memcpy (item->c, c, sizeof (c));
+  return self;
+}
+
+static VALUE
+scene_add_polyline (VALUE self, VALUE xy)
+{
+  struct scene *scene = get_mutable_scene (self);
+  struct scene_item *item;
+  long count, i;
+  const double *p = get_doubles (xy, &count);
+  double bbox[4] = { HUGE_VAL, HUGE_VAL, -HUGE_VAL, -HUGE_VAL };
+  if (count < 4 || count % 2 != 0)
+    rb_raise(rb_eArgError, "A polyline needs at least 2 packed (x, y) pairs!");
+  for (i = 0; i < count; i += 2)
+    {
+      if (p[i] < bbox[0]) bbox[0] = p[i];
+      if (p[i + 1] < bbox[1]) bbox[1] = p[i + 1];
+      if (p[i] > bbox[2]) bbox[2] = p[i];
+      if (p[i + 1] > bbox[3]) bbox[3] = p[i + 1];
+    }
+  if (scene->n_xy + count > scene->xy_cap)
+    {
+      while (scene->n_xy + count > scene->xy_cap)
+        scene->xy_cap = scene->xy_cap ? 2 * scene->xy_cap : 256;
+      REALLOC_N (scene->xy, double, scene->xy_cap);
+    }
+  item = scene_push (scene, SCENE_POLYLINE, bbox[0], bbox[1], bbox[2], bbox[3]);
+  item->c[0] = scene->n_xy;
+  item->c[1] = count / 2;
+  memcpy (scene->xy + scene->n_xy, p, count * sizeof (double));
+  scene->n_xy += count;
+  return self;
+}
+
+static VALUE
+scene_add_markers (VALUE self, VALUE xy, VALUE type, VALUE size)
+{
+  struct scene *scene = get_mutable_scene (self);
+  struct scene_item *item;
+  long count, i;
+  const double *p = get_doubles (xy, &count);
+  int t = NIL_P (type) ? -1 : NUM2INT (type);
+  double s = NIL_P (size) ? 0.0 : NUM2DBL (size);
+  for (i = 0; i + 1 < count; i += 2)
+    {
+      item = scene_push (scene, t < 0 ? SCENE_POINT : SCENE_MARKER,
+                         p[i] - s / 2, p[i + 1] - s / 2, p[i] + s / 2, p[i + 1] + s / 2);
+      item->c[0] = p[i];
+      item->c[1] = p[i + 1];
+      item->c[2] = t;
+      item->c[3] = s;
+    }
+  return self;
+}
+
+static long
+scene_cell (double v, double min, double max, long cells)
+{
+  double k = max > min ? (v - min) / (max - min) * cells : 0.0;
+  return k > 0 ? (k < cells ? (long)k : cells - 1) : 0;
+}
+
+static void
+scene_cell_range (const struct scene *scene, const double *bbox, long *range)
+{
+  range[0] = scene_cell (bbox[0], scene->bbox[0], scene->bbox[2], scene->cells_x);
+  range[1] = scene_cell (bbox[1], scene->bbox[1], scene->bbox[3], scene->cells_y);
+  range[2] = scene_cell (bbox[2], scene->bbox[0], scene->bbox[2], scene->cells_x);
+  range[3] = scene_cell (bbox[3], scene->bbox[1], scene->bbox[3], scene->cells_y);
+}
+
+static void
+scene_build_index (struct scene *scene, long cells)
+{
+  long i, x, y, range[4], *fill;
+  scene_drop_index (scene);
+  if (cells <= 0)
+    {
+      /* About four items per cell */
+      cells = (long)sqrt (scene->n_items / 4.0);
+      cells = cells < 1 ? 1 : (cells > 1024 ? 1024 : cells);
+    }
+  scene->cells_x = scene->cells_y = cells;
+  scene->cell_start = ALLOC_N (long, cells * cells + 1);
+  MEMZERO (scene->cell_start, long, cells * cells + 1);
+
+  /* Count the items of each cell, then place them in a second pass */
+  for (i = 0; i < scene->n_items; i++)
+    {
+      scene_cell_range (scene, scene->items[i].bbox, range);
+      for (y = range[1]; y <= range[3]; y++)
+        for (x = range[0]; x <= range[2]; x++)
+          scene->cell_start[y * cells + x + 1]++;
+    }
+  for (i = 0; i < cells * cells; i++)
+    scene->cell_start[i + 1] += scene->cell_start[i];
+  scene->cell_items = ALLOC_N (long, scene->cell_start[cells * cells] + 1);
+  fill = ALLOC_N (long, cells * cells);
+  memcpy (fill, scene->cell_start, cells * cells * sizeof (long));
+  for (i = 0; i < scene->n_items; i++)
+    {
+      scene_cell_range (scene, scene->items[i].bbox, range);
+      for (y = range[1]; y <= range[3]; y++)
+        for (x = range[0]; x <= range[2]; x++)
+          scene->cell_items[fill[y * cells + x]++] = i;
+    }
+  xfree (fill);
+}
+
+static VALUE
+scene_build (VALUE self, VALUE cells)
+{
+  scene_build_index (get_scene (self), NIL_P (cells) ? 0 : NUM2LONG (cells));
+  return self;
+}
+
+static VALUE
+scene_size (VALUE self)
+{
+  return LONG2NUM (get_scene (self)->n_items);
+}
+
+static void
+scene_draw_item (const struct scene *scene, const struct scene_item *item)
+{
+  long i;
+  const double *p;
+  switch (item->type)
+    {
+    case SCENE_LINE:
+      pl_fline (item->c[0], item->c[1], item->c[2], item->c[3]);
+      break;
+    case SCENE_BOX:
+      pl_fbox (item->c[0], item->c[1], item->c[2], item->c[3]);
+      break;
+    case SCENE_CIRCLE:
+      pl_fcircle (item->c[0], item->c[1], item->c[2]);
+      break;
+    case SCENE_ELLIPSE:
+      pl_fellipse (item->c[0], item->c[1], item->c[2], item->c[3], item->c[4]);
+      break;
+    case SCENE_POINT:
+      pl_fpoint (item->c[0], item->c[1]);
+      break;
+    case SCENE_MARKER:
+      pl_fmarker (item->c[0], item->c[1], (int)item->c[2], item->c[3]);
+      break;
+    case SCENE_POLYLINE:
+      p = scene->xy + (long)item->c[0];
+      pl_fmove (p[0], p[1]);
+      for (i = 1; i < (long)item->c[1]; i++)
+        pl_fcont (p[2 * i], p[2 * i + 1]);
+      pl_endpath ();
+      break;
+    }
+}
+
+static VALUE
+scene (VALUE self, VALUE scene_obj, VALUE x0, VALUE y0, VALUE x1, VALUE y1)
+{
+  struct scene *scene = get_scene (scene_obj);
+  double view[4];
+  long range[4], x, y, i, k, drawn = 0;
+  long long pen = -1, fill = -1;
+  unsigned long *marks;
+  VALUE marks_v;
+
+  get_handler (self);
+  view[0] = NUM2DBL (x0);
+  view[1] = NUM2DBL (y0);
+  view[2] = NUM2DBL (x1);
+  view[3] = NUM2DBL (y1);
+  if (pl_fspace (view[0], view[1], view[2], view[3]) < 0)
+    rb_raise(operation_plotter_error, "Couldn't set the Plotter window!");
+  if (view[0] > view[2]) { double t = view[0]; view[0] = view[2]; view[2] = t; }
+  if (view[1] > view[3]) { double t = view[1]; view[1] = view[3]; view[3] = t; }
+  if (scene->n_items == 0 || view[2] < scene->bbox[0] || view[0] > scene->bbox[2]
+      || view[3] < scene->bbox[1] || view[1] > scene->bbox[3])
+    return INT2FIX (0);
+  if (scene->cell_start == NULL)
+    scene_build_index (scene, 0);
+
+  /* Mark the candidates of the visible cells, then draw them in
+     insertion order */
+  k = (scene->n_items + 8 * sizeof (long) - 1) / (8 * sizeof (long));
+  marks = ALLOCV_N (unsigned long, marks_v, k);
+  memset (marks, 0, k * sizeof (unsigned long));
+  scene_cell_range (scene, view, range);
+  for (y = range[1]; y <= range[3]; y++)
+    for (x = range[0]; x <= range[2]; x++)
+      for (i = scene->cell_start[y * scene->cells_x + x]; i < scene->cell_start[y * scene->cells_x + x + 1]; i++)
+        marks[scene->cell_items[i] / (8 * sizeof (long))] |= 1UL << (scene->cell_items[i] % (8 * sizeof (long)));
+
+  pl_savestate ();
+  for (k = 0; k < scene->n_items; k += 8 * sizeof (long))
+    {
+      unsigned long word = marks[k / (8 * sizeof (long))];
+      for (i = k; word != 0; i++, word >>= 1)
+        {
+          const struct scene_item *item = &scene->items[i];
+          if (!(word & 1) || item->bbox[2] < view[0] || item->bbox[0] > view[2]
+              || item->bbox[3] < view[1] || item->bbox[1] > view[3])
+            continue;
+          /* Inherited colors come back from the saved state */
+          if ((item->pen < 0 && pen >= 0) || (item->fill < 0 && fill >= 0))
+            {
+              pl_restorestate ();
+              pl_savestate ();
+              pen = fill = -1;
+            }
+          if (item->pen != pen)
+            pl_pencolor (item->pen >> 32, item->pen >> 16 & 0xffff, item->pen & 0xffff);
+          if (item->fill != fill)
+            {
+              pl_filltype (1);
+              pl_fillcolor (item->fill >> 32, item->fill >> 16 & 0xffff, item->fill & 0xffff);
+            }
+          pen = item->pen;
+          fill = item->fill;
+          scene_draw_item (scene, item);
+          drawn++;
+        }
+    }
+  pl_restorestate ();
+  ALLOCV_END (marks_v);
+  return LONG2NUM (drawn);
+}
+
+/* Path */
+
+enum path_op
+{
+  PATH_MOVE, PATH_CONT, PATH_ARC, PATH_ELLARC, PATH_BEZIER2, PATH_BEZIER3, PATH_CLOSE
+};
+
+struct path_segment
+{
+  int op;
+  double c[8];
+};
+
+/* Coordinates of each segment type */
+static const int path_arity[] = { 2, 2, 6, 6, 6, 8, 0 };
+
+struct path
+{
+  struct path_segment *segments;
+  long n_segments, segments_cap;
+  double bbox[4];
+  /* SHA-256 of the segments, kept until the path is changed */
+  unsigned char digest[32];
+  int digested;
+};
+
+static void
+path_free (void *data)
+{
+  struct path *path = data;
+  xfree (path->segments);
+  xfree (path);
+}
+
+static size_t
+path_memsize (const void *data)
+{
+  const struct path *path = data;
+  return sizeof (struct path) + path->segments_cap * sizeof (struct path_segment);
+}
+
+static const rb_data_type_t path_data_type = {
+  "Rplot::Path",
+  { NULL, path_free, path_memsize, },
+  NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void
+path_reset (struct path *path)
+{
+  path->n_segments = 0;
+  path->bbox[0] = path->bbox[1] = HUGE_VAL;
+  path->bbox[2] = path->bbox[3] = -HUGE_VAL;
+}
+
+static VALUE
+path_alloc (VALUE klass)
+{
+  struct path *path;
+  VALUE obj = TypedData_Make_Struct (klass, struct path, &path_data_type, path);
+  path_reset (path);
+  return obj;
+}
+
+static struct path *
+get_path (VALUE obj)
+{
+  struct path *path;
+  TypedData_Get_Struct (obj, struct path, &path_data_type, path);
+  return path;
+}
+
+/* The path of obj, which is about to be changed */
+static struct path *
+get_mutable_path (VALUE obj)
+{
+  struct path *path;
+  rb_check_frozen (obj);
+  path = get_path (obj);
+  path->digested = 0;
+  return path;
+}
+
+static VALUE
+path_init_copy (VALUE self, VALUE orig)
+{
+  struct path *path, *src;
+  if (self == orig)
+    return self;
+  path = get_mutable_path (self);
+  src = get_path (orig);
+  if (src->n_segments > path->segments_cap)
+    {
+      path->segments_cap = src->n_segments;
+      REALLOC_N (path->segments, struct path_segment, path->segments_cap);
+    }
+  MEMCPY (path->segments, src->segments, struct path_segment, src->n_segments);
+  path->n_segments = src->n_segments;
+  memcpy (path->bbox, src->bbox, sizeof (path->bbox));
+  memcpy (path->digest, src->digest, sizeof (path->digest));
+  path->digested = src->digested;
+  return self;
+}
+
+static void
+path_extend (struct path *path, double x0, double y0, double x1, double y1)
+{
+  if (x0 < path->bbox[0]) path->bbox[0] = x0;
+  if (y0 < path->bbox[1]) path->bbox[1] = y0;
+  if (x1 > path->bbox[2]) path->bbox[2] = x1;
+  if (y1 > path->bbox[3]) path->bbox[3] = y1;
+}
+
+static VALUE
+path_add (VALUE self, VALUE op, VALUE coords)
+{
+  struct path *path = get_mutable_path (self);
+  struct path_segment *segment;
+  int o = NUM2INT (op), i;
+  double r;
+
+  if (o < PATH_MOVE || o > PATH_CLOSE)
+    rb_raise(rb_eArgError, "Unknown path segment %d!", o);
+  Check_Type (coords, T_ARRAY);
+  if (RARRAY_LEN (coords) != path_arity[o])
+    rb_raise(rb_eArgError, "Path segment %d takes %d coordinates!", o, path_arity[o]);
+  if (path->n_segments == path->segments_cap)
+    {
+      path->segments_cap = path->segments_cap ? 2 * path->segments_cap : 16;
+      REALLOC_N (path->segments, struct path_segment, path->segments_cap);
+    }
+  segment = &path->segments[path->n_segments];
+  segment->op = o;
+  for (i = 0; i < path_arity[o]; i++)
+    segment->c[i] = NUM2DBL (rb_ary_entry (coords, i));
+  path->n_segments++;
+
+  /* Control points bound Bezier curves; a circular arc is bounded by
+     its circle, a quarter ellipse by its control triangle */
+  switch (o)
+    {
+    case PATH_ARC:
+      r = hypot (segment->c[2] - segment->c[0], segment->c[3] - segment->c[1]);
+      path_extend (path, segment->c[0] - r, segment->c[1] - r, segment->c[0] + r, segment->c[1] + r);
+      break;
+    case PATH_ELLARC:
+      path_extend (path, segment->c[2], segment->c[3], segment->c[2], segment->c[3]);
+      path_extend (path, segment->c[4], segment->c[5], segment->c[4], segment->c[5]);
+      r = segment->c[2] + segment->c[4] - segment->c[0];
+      path_extend (path, r, segment->c[3] + segment->c[5] - segment->c[1], r,
+                   segment->c[3] + segment->c[5] - segment->c[1]);
+      break;
+    default:
+      for (i = 0; i < path_arity[o]; i += 2)
+        path_extend (path, segment->c[i], segment->c[i + 1], segment->c[i], segment->c[i + 1]);
+    }
+  return self;
+}
+
+static VALUE
+path_clear (VALUE self)
+{
+  path_reset (get_mutable_path (self));
+  return self;
+}
+
+static VALUE
+path_size (VALUE self)
+{
+  return LONG2NUM (get_path (self)->n_segments);
+}
+
+static VALUE
+path_bbox (VALUE self)
+{
+  struct path *path = get_path (self);
+  if (path->n_segments == 0)
+    return Qnil;
+  return rb_ary_new3 (4, DBL2NUM (path->bbox[0]), DBL2NUM (path->bbox[1]),
+                      DBL2NUM (path->bbox[2]), DBL2NUM (path->bbox[3]));
+}
+
+static void
+path_emit (const struct path *path)
+{
+  long i;
+  for (i = 0; i < path->n_segments; i++)
+    {
+      const double *c = path->segments[i].c;
+      switch (path->segments[i].op)
+        {
+        case PATH_MOVE:
+          /* A bare move would end the path: later moves start the
+             next simple path of a compound path */
+          if (i > 0)
+            pl_endsubpath ();
+          pl_fmove (c[0], c[1]);
+          break;
+        case PATH_CONT: pl_fcont (c[0], c[1]); break;
+        case PATH_ARC: pl_farc (c[0], c[1], c[2], c[3], c[4], c[5]); break;
+        case PATH_ELLARC: pl_fellarc (c[0], c[1], c[2], c[3], c[4], c[5]); break;
+        case PATH_BEZIER2: pl_fbezier2 (c[0], c[1], c[2], c[3], c[4], c[5]); break;
+        case PATH_BEZIER3: pl_fbezier3 (c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7]); break;
+        case PATH_CLOSE: pl_closepath (); break;
+        }
+    }
+  pl_endpath ();
+}
+
+static VALUE
+path (VALUE self, VALUE path_obj)
+{
+  struct path *path = get_path (path_obj);
+  get_handler (self);
+  path_emit (path);
+  return LONG2NUM (path->n_segments);
+}
+
+static const double *
+get_doubles_or_scalar (VALUE values, long n, double *scalar, const char *name)
+{
+  long count;
+  const double *p;
+  if (TYPE (values) != T_STRING)
+    {
+      *scalar = NUM2DBL (values);
+      return NULL;
+    }
+  p = get_doubles (values, &count);
+  if (count != n)
+    rb_raise(rb_eArgError, "Expected %ld %s, got %ld!", n, name, count);
+  return p;
+}
+
+static VALUE
+stamp (VALUE self, VALUE path_obj, VALUE xs, VALUE ys, VALUE angles, VALUE scales)
+{
+  struct path *path = get_path (path_obj);
+  long n, count, i;
+  const double *x = get_doubles (xs, &n);
+  const double *y = get_doubles (ys, &count);
+  const double *angle, *scale;
+  double angle0 = 0.0, scale0 = 1.0;
+
+  get_handler (self);
+  if (count != n)
+    rb_raise(rb_eArgError, "Coordinates must have the same length!");
+  angle = get_doubles_or_scalar (angles, n, &angle0, "angles");
+  scale = get_doubles_or_scalar (scales, n, &scale0, "scales");
+
+  /* Each instance is drawn in its own graphics context, mapped by the
+     matrix of translate(x, y) rotate(angle) scale(scale) */
+  for (i = 0; i < n; i++)
+    {
+      double a = (angle ? angle[i] : angle0) * M_PI / 180.0;
+      double k = scale ? scale[i] : scale0;
+      double c = k * cos (a), s = k * sin (a);
+      pl_savestate ();
+      pl_fconcat (c, s, -s, c, x[i], y[i]);
+      path_emit (path);
+      pl_restorestate ();
+    }
+  return LONG2NUM (n);
+}
+
+/* Axis */
+
+enum axis_scale
+{
+  AXIS_LINEAR, AXIS_LOG, AXIS_TIME
+};
+
+#define AXIS_MAX_TICKS 1024
+
+/* Log axes are laid out in log10 user coordinates */
+#define AXIS_COORD(scale, value) ((scale) == AXIS_LOG ? log10 (value) : (value))
+
+/* Heckbert's nice numbers: 1, 2, 5 (or 10) times a power of ten */
+static double
+axis_nice (double x, int round)
+{
+  double e = floor (log10 (x)), f = x / pow (10.0, e), n;
+  if (round)
+    n = f < 1.5 ? 1 : (f < 3 ? 2 : (f < 7 ? 5 : 10));
+  else
+    n = f <= 1 ? 1 : (f <= 2 ? 2 : (f <= 5 ? 5 : 10));
+  return n * pow (10.0, e);
+}
+
+/* The 1, 2, 5 step just below step */
+static double
+axis_smaller (double step)
+{
+  double e = pow (10.0, floor (log10 (step) + 1e-9)), f = step / e;
+  return f < 1.5 ? e / 2 : (f < 3 ? e : 2 * e);
+}
+
+/* Number of multiples of step in [min, max] */
+static long
+axis_multiples (double min, double max, double step)
+{
+  return (long)floor (max / step + 1e-9) - (long)ceil (min / step - 1e-9) + 1;
+}
+
+/* At most count ticks, count being at least 2, and as many as fit */
+static long
+axis_ticks (int scale, double min, double max, int count, double *ticks)
+{
+  static const double time_steps[] = {
+    1, 2, 5, 10, 15, 30, 60, 120, 300, 600, 900, 1800, 3600, 7200, 10800, 21600,
+    43200, 86400, 172800, 604800, 2592000, 7776000, 31536000
+  };
+  static const long n_time_steps = sizeof (time_steps) / sizeof (double);
+  long n = 0, i;
+  double step, unit, t;
+
+  if (count < 2)
+    count = 2;
+  if (count > AXIS_MAX_TICKS)
+    count = AXIS_MAX_TICKS;
+  switch (scale)
+    {
+    case AXIS_LOG:
+      {
+        /* Every k-th power of ten, with 2 and 5 multiples on short
+           ranges when they fit */
+        static const double multiples[] = { 1, 2, 5 };
+        double lo = log10 (min), hi = log10 (max);
+        int e, m, k = 1, dense;
+        while (axis_multiples (lo, hi, k) > count)
+          k++;
+        dense = k == 1 && hi - lo < 2;
+        for (e = (int)ceil (lo / k - 1e-9) * k - (dense ? 1 : 0); e <= (int)floor (hi + 1e-9); e += k)
+          for (m = 0; m < (dense ? 3 : 1); m++)
+            {
+              t = multiples[m] * pow (10.0, e);
+              if (t >= min * (1 - 1e-9) && t <= max * (1 + 1e-9))
+                ticks[n++] = t;
+            }
+        if (n <= count)
+          return n;
+        /* Too many with the multiples: powers only */
+        for (n = 0, e = (int)ceil (lo - 1e-9); e <= (int)floor (hi + 1e-9); e++)
+          ticks[n++] = pow (10.0, e);
+        return n;
+      }
+    case AXIS_TIME:
+      for (i = 0; i < n_time_steps && axis_multiples (min, max, time_steps[i]) > count; i++)
+        ;
+      step = i < n_time_steps ? time_steps[i] : time_steps[n_time_steps - 1];
+      while (axis_multiples (min, max, step) > count)
+        step *= 2;
+      break;
+    default:
+      step = axis_nice (axis_nice (max - min, 0) / (count - 1), 1);
+      /* Loose nice numbers may overshoot: next 1, 2, 5 step */
+      while (axis_multiples (min, max, step) > count)
+        step = axis_nice (step * 1.5, 1);
+      /* Or undershoot, e.g. a single tick 0.5 for 0.1...0.7: the
+         smallest step that still fits, the range being positive */
+      while (axis_multiples (min, max, axis_smaller (step)) <= count)
+        step = axis_smaller (step);
+    }
+  /* Divide fractional steps by a power of ten, so that ticks like 0.3
+     come out as the closest double */
+  unit = step < 1 ? pow (10.0, -floor (log10 (step))) : 1;
+  for (i = (long)ceil (min / step - 1e-9); (t = i * round (step * unit) / unit) <= max + step * 1e-9 && n < count; i++)
+    ticks[n++] = t;
+  return n;
+}
+
+/* Whether format is safe to use with a single double: exactly one
+   %[flags][width][.precision] conversion among e, E, f, g and G, any
+   other % being written %% */
+static int
+axis_valid_format (const char *format)
+{
+  int conversions = 0;
+  for (; *format; format++)
+    {
+      if (*format != '%')
+        continue;
+      if (*++format == '%')
+        continue;
+      format += strspn (format, "-+ #0");
+      format += strspn (format, "0123456789");
+      if (*format == '.')
+        format += 1 + strspn (format + 1, "0123456789");
+      if (*format == '\0' || strchr ("eEfgG", *format) == NULL)
+        return 0;
+      conversions++;
+    }
+  return conversions == 1;
+}
+
+static void
+axis_format (char *buf, size_t size, int scale, const char *format, double value, double step)
+{
+  if (scale == AXIS_TIME)
+    {
+      time_t t = (time_t)value;
+      struct tm tm;
+      gmtime_r (&t, &tm);
+      if (format == NULL)
+        format = step < 60 ? "%H:%M:%S" : (step < 86400 ? "%H:%M" : "%Y-%m-%d");
+      if (strftime (buf, size, format, &tm) == 0)
+        buf[0] = '\0';
+    }
+  else
+    snprintf (buf, size, format ? format : "%g", value);
+}
+
+static VALUE
+axis (VALUE self, VALUE min, VALUE max, VALUE orientation, VALUE position, VALUE scale, VALUE count, VALUE tick_size, VALUE format)
+{
+  double ticks[AXIS_MAX_TICKS], extents[AXIS_MAX_TICKS];
+  double lo = NUM2DBL (min), hi = NUM2DBL (max), pos = NUM2DBL (position);
+  double size, gap, height, step;
+  const char *fmt = NIL_P (format) ? NULL : StringValueCStr (format);
+  int sc = NUM2INT (scale), side = NUM2INT (orientation);
+  int horizontal = side == 'b' || side == 't', flip = side == 'b' || side == 'l' ? -1 : 1;
+  long n, i, every;
+  char buf[128];
+  VALUE result;
+
+  get_handler (self);
+  if (fmt != NULL && sc != AXIS_TIME && !axis_valid_format (fmt))
+    rb_raise(rb_eArgError, "Axis format must have a single %%e, %%f or %%g conversion: %s!", fmt);
+  if (lo > hi)
+    {
+      double t = lo;
+      lo = hi;
+      hi = t;
+    }
+  if (!(hi > lo) || (sc == AXIS_LOG && lo <= 0))
+    rb_raise(rb_eArgError, "Invalid axis range %g...%g!", lo, hi);
+  size = NIL_P (tick_size) ? (AXIS_COORD (sc, hi) - AXIS_COORD (sc, lo)) / 50 : NUM2DBL (tick_size);
+  n = axis_ticks (sc, lo, hi, NUM2INT (count), ticks);
+  step = n > 1 ? ticks[1] - ticks[0] : hi - lo;
+
+  /* Measure the labels with the current font, the height of a line
+     being estimated from the width of "M" */
+  height = pl_flabelwidth ("M");
+  gap = height / 2;
+  for (i = 0; i < n; i++)
+    {
+      axis_format (buf, sizeof (buf), sc, fmt, ticks[i], step);
+      extents[i] = horizontal ? pl_flabelwidth (buf) : height;
+    }
+
+  /* Keep every k-th label, with the smallest k without overlaps */
+  for (every = 1; every < n; every++)
+    {
+      for (i = 0; i + every < n; i += every)
+        if (AXIS_COORD (sc, ticks[i + every]) - AXIS_COORD (sc, ticks[i]) < (extents[i] + extents[i + every]) / 2 + gap)
+          break;
+      if (i + every >= n)
+        break;
+    }
+
+  pl_savestate ();
+  if (horizontal)
+    pl_fline (AXIS_COORD (sc, lo), pos, AXIS_COORD (sc, hi), pos);
+  else
+    pl_fline (pos, AXIS_COORD (sc, lo), pos, AXIS_COORD (sc, hi));
+  for (i = 0; i < n; i++)
+    if (horizontal)
+      pl_fline (AXIS_COORD (sc, ticks[i]), pos, AXIS_COORD (sc, ticks[i]), pos + flip * size);
+    else
+      pl_fline (pos, AXIS_COORD (sc, ticks[i]), pos + flip * size, AXIS_COORD (sc, ticks[i]));
+  result = rb_ary_new2 (n);
+  for (i = 0; i < n; i++)
+    {
+      rb_ary_push (result, DBL2NUM (ticks[i]));
+      if (i % every != 0)
+        continue;
+      axis_format (buf, sizeof (buf), sc, fmt, ticks[i], step);
+      if (horizontal)
+        {
+          pl_fmove (AXIS_COORD (sc, ticks[i]), pos + flip * (size + gap));
+          pl_alabel ('c', side == 'b' ? 't' : 'b', buf);
+        }
+      else
+        {
+          pl_fmove (pos + flip * (size + gap), AXIS_COORD (sc, ticks[i]));
+          pl_alabel (side == 'l' ? 'r' : 'l', 'c', buf);
+        }
+    }
+  pl_restorestate ();
+  return result;
+}
+
+/* Digest: a streaming SHA-256 of the data fed so far, used as the key
+   of rendered outputs in Plotter.cached_draw */
+
+struct digest
+{
+  uint32_t h[8];
+  unsigned char tail[64];
+  size_t tail_len;
+  uint64_t length;
+};
+
+#define ROTR32(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+static const uint32_t digest_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void
+digest_init (struct digest *digest)
+{
+  static const uint32_t h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy (digest->h, h0, sizeof (h0));
+  digest->tail_len = 0;
+  digest->length = 0;
+}
+
+static void
+digest_block (uint32_t *h, const unsigned char *block)
+{
+  uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+  int i;
+  for (i = 0; i < 16; i++)
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  for (; i < 64; i++)
+    w[i] = w[i - 16] + (ROTR32 (w[i - 15], 7) ^ ROTR32 (w[i - 15], 18) ^ (w[i - 15] >> 3))
+      + w[i - 7] + (ROTR32 (w[i - 2], 17) ^ ROTR32 (w[i - 2], 19) ^ (w[i - 2] >> 10));
+  a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4]; f = h[5]; g = h[6]; k = h[7];
+  for (i = 0; i < 64; i++)
+    {
+      t1 = k + (ROTR32 (e, 6) ^ ROTR32 (e, 11) ^ ROTR32 (e, 25)) + ((e & f) ^ (~e & g)) + digest_k[i] + w[i];
+      t2 = (ROTR32 (a, 2) ^ ROTR32 (a, 13) ^ ROTR32 (a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      k = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void
+digest_update (struct digest *digest, const void *data, size_t size)
+{
+  const unsigned char *p = data;
+  digest->length += size;
+  if (digest->tail_len > 0)
+    {
+      size_t n = 64 - digest->tail_len < size ? 64 - digest->tail_len : size;
+      memcpy (digest->tail + digest->tail_len, p, n);
+      digest->tail_len += n;
+      p += n;
+      size -= n;
+      if (digest->tail_len < 64)
+        return;
+      digest_block (digest->h, digest->tail);
+      digest->tail_len = 0;
+    }
+  for (; size >= 64; p += 64, size -= 64)
+    digest_block (digest->h, p);
+  memcpy (digest->tail, p, size);
+  digest->tail_len = size;
+}
+
+/* Finalizes a copy of the state, so that more data can be fed */
+static void
+digest_final (const struct digest *digest, unsigned char *out)
+{
+  uint32_t h[8];
+  unsigned char block[128];
+  uint64_t bits = digest->length * 8;
+  size_t n = digest->tail_len < 56 ? 64 : 128;
+  int i;
+  memcpy (h, digest->h, sizeof (h));
+  memset (block, 0, sizeof (block));
+  memcpy (block, digest->tail, digest->tail_len);
+  block[digest->tail_len] = 0x80;
+  for (i = 0; i < 8; i++)
+    block[n - 1 - i] = (unsigned char)(bits >> (i * 8));
+  digest_block (h, block);
+  if (n == 128)
+    digest_block (h, block + 64);
+  for (i = 0; i < 32; i++)
+    out[i] = (unsigned char)(h[i / 4] >> (24 - (i % 4) * 8));
+}
+
+static void
+digest_tag (struct digest *digest, char tag, int64_t n)
+{
+  digest_update (digest, &tag, 1);
+  digest_update (digest, &n, sizeof (n));
+}
+
+/* Feeds a tagged encoding of value, so that different arguments never
+   feed the same bytes. Paths and scenes are fed by the digest of their
+   content, computed once until they are changed. */
+static void
+digest_value (struct digest *digest, VALUE value)
+{
+  long i, n;
+  double d;
+  switch (TYPE (value))
+    {
+    case T_NIL: digest_tag (digest, 'n', 0); break;
+    case T_TRUE: digest_tag (digest, 't', 0); break;
+    case T_FALSE: digest_tag (digest, 'f', 0); break;
+    case T_FIXNUM: digest_tag (digest, 'i', FIX2LONG (value)); break;
+    case T_BIGNUM:
+      value = rb_big2str (value, 16);
+      digest_tag (digest, 'I', RSTRING_LEN (value));
+      digest_update (digest, RSTRING_PTR (value), RSTRING_LEN (value));
+      break;
+    case T_FLOAT:
+      d = RFLOAT_VALUE (value);
+      digest_tag (digest, 'd', 0);
+      digest_update (digest, &d, sizeof (d));
+      break;
+    case T_SYMBOL:
+      value = rb_sym2str (value);
+      digest_tag (digest, 'y', RSTRING_LEN (value));
+      digest_update (digest, RSTRING_PTR (value), RSTRING_LEN (value));
+      break;
+    case T_STRING:
+      digest_tag (digest, 's', RSTRING_LEN (value));
+      digest_update (digest, RSTRING_PTR (value), RSTRING_LEN (value));
+      break;
+    case T_ARRAY:
+      digest_tag (digest, 'a', RARRAY_LEN (value));
+      for (i = 0; i < RARRAY_LEN (value); i++)
+        digest_value (digest, RARRAY_AREF (value, i));
+      break;
+    case T_HASH:
+      value = rb_funcall (value, rb_intern ("to_a"), 0);
+      digest_tag (digest, 'h', RARRAY_LEN (value));
+      for (i = 0; i < RARRAY_LEN (value); i++)
+        digest_value (digest, RARRAY_AREF (value, i));
+      break;
+    default:
+      if (rb_typeddata_is_kind_of (value, &path_data_type))
+        {
+          struct path *path = get_path (value);
+          if (!path->digested)
+            {
+              struct digest content;
+              digest_init (&content);
+              for (i = 0; i < path->n_segments; i++)
+                {
+                  digest_tag (&content, 'o', path->segments[i].op);
+                  digest_update (&content, path->segments[i].c, path_arity[path->segments[i].op] * sizeof (double));
+                }
+              digest_final (&content, path->digest);
+              path->digested = 1;
+            }
+          digest_tag (digest, 'P', path->n_segments);
+          digest_update (digest, path->digest, sizeof (path->digest));
+        }
+      else if (rb_typeddata_is_kind_of (value, &scene_data_type))
+        {
+          struct scene *scene = get_scene (value);
+          if (!scene->digested)
+            {
+              struct digest content;
+              digest_init (&content);
+              for (i = 0; i < scene->n_items; i++)
+                {
+                  struct scene_item *item = &scene->items[i];
+                  /* Only the coordinates set for the item type */
+                  n = item->type == SCENE_POLYLINE || item->type == SCENE_POINT ? 2 : (item->type == SCENE_MARKER ? 4 : 5);
+                  digest_tag (&content, 'o', item->type);
+                  digest_update (&content, item->c, n * sizeof (double));
+                  digest_update (&content, &item->pen, sizeof (item->pen));
+                  digest_update (&content, &item->fill, sizeof (item->fill));
+                }
+              digest_update (&content, scene->xy, scene->n_xy * sizeof (double));
+              digest_final (&content, scene->digest);
+              scene->digested = 1;
+            }
+          digest_tag (digest, 'S', scene->n_items);
+          digest_update (digest, scene->digest, sizeof (scene->digest));
+        }
+      else
+        rb_raise(rb_eTypeError, "Can't digest a %s!", rb_obj_classname (value));
+    }
+}
+
+static const rb_data_type_t digest_data_type = {
+  "Rplot::Digest",
+  { NULL, RUBY_TYPED_DEFAULT_FREE, NULL },
+  NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+digest_alloc (VALUE klass)
+{
+  struct digest *digest;
+  VALUE obj = TypedData_Make_Struct (klass, struct digest, &digest_data_type, digest);
+  digest_init (digest);
+  return obj;
+}
+
+static struct digest *
+get_digest (VALUE obj)
+{
+  struct digest *digest;
+  TypedData_Get_Struct (obj, struct digest, &digest_data_type, digest);
+  return digest;
+}
+
+static VALUE
+digest_update_string (VALUE self, VALUE data)
+{
+  StringValue (data);
+  digest_update (get_digest (self), RSTRING_PTR (data), RSTRING_LEN (data));
+  return self;
+}
+
+static VALUE
+digest_op (VALUE self, VALUE name, VALUE args)
+{
+  struct digest *digest = get_digest (self);
+  digest_value (digest, name);
+  digest_value (digest, args);
+  return self;
+}
+
+static VALUE
+digest_hexdigest (VALUE self)
+{
+  static const char digits[] = "0123456789abcdef";
+  unsigned char out[32];
+  char hex[64];
+  int i;
+  digest_final (get_digest (self), out);
+  for (i = 0; i < 32; i++)
+    {
+      hex[i * 2] = digits[out[i] >> 4];
+      hex[i * 2 + 1] = digits[out[i] & 15];
+    }
+  return rb_str_new (hex, 64);
+}
+
 /* Init rplot */
 
 void
@@ -855,10 +3715,16 @@ Init_rplot ()
   operation_plotter_error = rb_define_class ("OperationPlotterError", rb_eStandardError);
   /* Define Rplot class */
   VALUE rplot = rb_define_class ("Rplot", rb_cObject);
+  rb_define_alloc_func (rplot, plotter_alloc);
   /* Base functions */
-  rb_define_protected_method (rplot, "initialize", newpl, 4);
+  rb_define_protected_method (rplot, "initialize", newpl, 8);
   rb_define_protected_method (rplot, "delete", deletepl, 0);
+  rb_define_protected_method (rplot, "deleted?", deletedpl, 0);
+  rb_define_protected_method (rplot, "memsize", memsizepl, 0);
   rb_define_singleton_method (rplot, "param", parampl, 2);
+  rb_define_singleton_method (rplot, "current_params", current_params, 0);
+  param_values = rb_hash_new ();
+  rb_gc_register_address (&param_values);
   /* Setup functions */
   rb_define_protected_method (rplot, "open", openpl, 0);
   rb_define_protected_method (rplot, "bgcolor", bgcolor, 3);
@@ -955,5 +3821,70 @@ Init_rplot ()
   rb_define_protected_method (rplot, "frotate", frotate, 1);
   rb_define_protected_method (rplot, "fscale", fscale, 2);
   rb_define_protected_method (rplot, "ftranslate", ftranslate, 2);
+  /* Batch functions */
+  rb_define_protected_method (rplot, "heatmap", heatmap, 6);
+  rb_define_protected_method (rplot, "contour", contour, 5);
+  rb_define_protected_method (rplot, "labels", labels, 6);
+  rb_define_protected_method (rplot, "polyline", polyline, 3);
+  rb_define_protected_method (rplot, "plot_file", plot_file, 7);
+  rb_define_protected_method (rplot, "polygons", polygons, 5);
+  /* Tiled rendering */
+  rb_define_singleton_method (rplot, "stitch_pnm", stitch_pnm, 2);
+  /* Tracing */
+  rb_define_singleton_method (rplot, "trace_start", trace_start, 1);
+  rb_define_singleton_method (rplot, "trace_stop", trace_stop, 1);
+  rb_gc_register_address (&trace_hook);
+  rb_gc_register_address (&trace_thread);
+#ifdef HAVE_RB_TRACEPOINT_NEW
+  id_trace_start = rb_intern ("trace_start");
+  id_trace_stop = rb_intern ("trace_stop");
+#endif
+  /* Scene */
+  rb_define_protected_method (rplot, "scene", scene, 5);
+  VALUE rscene = rb_define_class_under (rplot, "Scene", rb_cObject);
+  rb_define_alloc_func (rscene, scene_alloc);
+  rb_define_const (rscene, "LINE", INT2FIX (SCENE_LINE));
+  rb_define_const (rscene, "BOX", INT2FIX (SCENE_BOX));
+  rb_define_const (rscene, "CIRCLE", INT2FIX (SCENE_CIRCLE));
+  rb_define_const (rscene, "ELLIPSE", INT2FIX (SCENE_ELLIPSE));
+  rb_define_const (rscene, "POINT", INT2FIX (SCENE_POINT));
+  rb_define_const (rscene, "MARKER", INT2FIX (SCENE_MARKER));
+  rb_define_protected_method (rscene, "colors", scene_colors, 2);
+  rb_define_protected_method (rscene, "add", scene_add, 2);
+  rb_define_protected_method (rscene, "add_polyline", scene_add_polyline, 1);
+  rb_define_protected_method (rscene, "add_markers", scene_add_markers, 3);
+  rb_define_protected_method (rscene, "build_index", scene_build, 1);
+  rb_define_method (rscene, "size", scene_size, 0);
+  rb_define_method (rscene, "initialize_copy", scene_init_copy, 1);
+  /* Path */
+  rb_define_protected_method (rplot, "path", path, 1);
+  rb_define_protected_method (rplot, "stamp", stamp, 5);
+  /* Axis */
+  rb_define_protected_method (rplot, "axis", axis, 8);
+  VALUE rpath = rb_define_class_under (rplot, "Path", rb_cObject);
+  rb_define_alloc_func (rpath, path_alloc);
+  rb_define_const (rpath, "MOVE", INT2FIX (PATH_MOVE));
+  rb_define_const (rpath, "CONT", INT2FIX (PATH_CONT));
+  rb_define_const (rpath, "ARC", INT2FIX (PATH_ARC));
+  rb_define_const (rpath, "ELLARC", INT2FIX (PATH_ELLARC));
+  rb_define_const (rpath, "BEZIER2", INT2FIX (PATH_BEZIER2));
+  rb_define_const (rpath, "BEZIER3", INT2FIX (PATH_BEZIER3));
+  rb_define_const (rpath, "CLOSE", INT2FIX (PATH_CLOSE));
+  rb_define_protected_method (rpath, "add", path_add, 2);
+  rb_define_method (rpath, "clear", path_clear, 0);
+  rb_define_method (rpath, "size", path_size, 0);
+  rb_define_method (rpath, "bbox", path_bbox, 0);
+  rb_define_method (rpath, "initialize_copy", path_init_copy, 1);
+  /* Traced classes */
+  trace_classes[0] = rplot;
+  trace_classes[1] = rb_singleton_class (rplot);
+  trace_classes[2] = rscene;
+  trace_classes[3] = rpath;
+  /* Define Rplot::Digest class */
+  VALUE rdigest = rb_define_class_under (rplot, "Digest", rb_cObject);
+  rb_define_alloc_func (rdigest, digest_alloc);
+  rb_define_method (rdigest, "update", digest_update_string, 1);
+  rb_define_method (rdigest, "op", digest_op, 2);
+  rb_define_method (rdigest, "hexdigest", digest_hexdigest, 0);
 }
 
@@ -2,16 +2,50 @@
 #define RUBY_PLOT
 
 #include <ruby.h>
+#include <ruby/version.h>
 #include <plot.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+#include <math.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_RUBY_DEBUG_H
+#include <ruby/debug.h>
+#endif
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
 #include "rplot_exceptions.h"
 
+/* Tracing */
+
+static VALUE trace_start (VALUE self, VALUE events);
+static VALUE trace_stop (VALUE self, VALUE path);
+
 /* 4 base functions */
 
-static VALUE new_pl (VALUE self, VALUE type, VALUE in_path, VALUE out_path, VALUE err_path);
-//static VALUE select_pl (VALUE self);
-static VALUE delete_pl (VALUE self);
+static VALUE newpl (VALUE self, VALUE type, VALUE in_path, VALUE out_path, VALUE err_path, VALUE buffer_size, VALUE preallocate, VALUE sync, VALUE compress);
+//static VALUE selectpl (VALUE self);
+static VALUE deletepl (VALUE self);
+static VALUE deletedpl (VALUE self);
+static VALUE memsizepl (VALUE self);
 static VALUE parampl (VALUE self, VALUE param, VALUE value);
+static VALUE current_params (VALUE self);
 
 /* Setup functions */
 
@@ -117,5 +151,49 @@ static VALUE frotate (VALUE self, VALUE theta);
 static VALUE fscale (VALUE self, VALUE sx, VALUE sy);
 static VALUE ftranslate (VALUE self, VALUE tx, VALUE ty);
 
+/* Batch functions */
+
+static VALUE heatmap (VALUE self, VALUE matrix, VALUE columns, VALUE colormap, VALUE range, VALUE window, VALUE merge);
+static VALUE contour (VALUE self, VALUE grid, VALUE columns, VALUE levels, VALUE window, VALUE threads);
+static VALUE labels (VALUE self, VALUE xs, VALUE ys, VALUE strings, VALUE horiz_justify, VALUE vert_justify, VALUE angles);
+static VALUE polyline (VALUE self, VALUE xs, VALUE ys, VALUE start);
+static VALUE plot_file (VALUE self, VALUE path, VALUE format, VALUE fields, VALUE x_col, VALUE y_col, VALUE marker, VALUE marker_size);
+static VALUE polygons (VALUE self, VALUE coords, VALUE ring_offsets, VALUE polygon_offsets, VALUE colors, VALUE fill_rule);
+
+/* Tiled rendering */
+
+static VALUE stitch_pnm (VALUE self, VALUE out_path, VALUE tile_paths);
+
+/* Scene */
+
+static VALUE scene_colors (VALUE self, VALUE pen, VALUE fill);
+static VALUE scene_add (VALUE self, VALUE type, VALUE coords);
+static VALUE scene_add_polyline (VALUE self, VALUE xy);
+static VALUE scene_add_markers (VALUE self, VALUE xy, VALUE type, VALUE size);
+static VALUE scene_build (VALUE self, VALUE cells);
+static VALUE scene_size (VALUE self);
+static VALUE scene_init_copy (VALUE self, VALUE orig);
+static VALUE scene (VALUE self, VALUE scene, VALUE x0, VALUE y0, VALUE x1, VALUE y1);
+
+/* Path */
+
+static VALUE path_add (VALUE self, VALUE op, VALUE coords);
+static VALUE path_clear (VALUE self);
+static VALUE path_size (VALUE self);
+static VALUE path_bbox (VALUE self);
+static VALUE path_init_copy (VALUE self, VALUE orig);
+static VALUE path (VALUE self, VALUE path);
+static VALUE stamp (VALUE self, VALUE path, VALUE xs, VALUE ys, VALUE angles, VALUE scales);
+
+/* Axis */
+
+static VALUE axis (VALUE self, VALUE min, VALUE max, VALUE orientation, VALUE position, VALUE scale, VALUE count, VALUE tick_size, VALUE format);
+
+/* Digest */
+
+static VALUE digest_update_string (VALUE self, VALUE data);
+static VALUE digest_op (VALUE self, VALUE name, VALUE args);
+static VALUE digest_hexdigest (VALUE self);
+
 #endif
 
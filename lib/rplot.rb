@@ -1,4 +1,6 @@
 #require 'ext/rplot'
+require 'tmpdir'
+require 'fileutils'
 require File.expand_path('../../ext/rplot', __FILE__)
 # This class rappresents a Plotter.
 #
@@ -228,13 +230,49 @@ class Plotter < Rplot
   # ignored as well. Error messages (if any) are written to the stream
   # created with +err_path+, unless +err_path+ is +nil+.
   #
-  # +OpenPlotterError+ exception will be raise if the Plotter could
+  # The output and error streams opened from +out_path+ and +err_path+
+  # belong to the Plotter: they are closed when the Plotter is deleted,
+  # or when it is garbage collected. The last argument may be an
+  # options hash with the following keys:
+  #
+  # [buffer_size] The size in bytes of the output stream write buffer,
+  #               instead of the stdio default. Large buffers make
+  #               fewer +write+ system calls for large outputs.
+  # [preallocate] Reserve this many bytes for the output file when it
+  #               is created, where the system supports it. Unused
+  #               space is given back when the Plotter is deleted.
+  # [fsync] If +true+, the output file is synced to disk when the
+  #         Plotter is deleted.
+  # [compress] Write the output gzip compressed, e.g. for _svgz_ or
+  #            <i>ps.gz</i> files, in a single pass. The value is the
+  #            zlib compression level (0 to 9), +true+ for the
+  #            default level, or +false+ for no compression.
+  #
+  # The +buffer_size+, +preallocate+ and +compress+ options apply to
+  # the stream opened from +out_path+: if it is +nil+ they raise
+  # ArgumentError.
+  #
+  # +CreatePlotterError+ exception will be raise if the Plotter could
   # not be create.
-  def initialize(type, out_path, in_path = nil, err_path = nil)
-    super(type, in_path, out_path, err_path)
+  def initialize(type, out_path, in_path = nil, err_path = nil, options = {})
+    options, in_path = in_path, nil if in_path.class == Hash
+    options, err_path = err_path, nil if err_path.class == Hash
+    compress = case options[:compress]
+               when nil, false then nil
+               when true then -1
+               when 0..9 then options[:compress]
+               else raise ArgumentError, "Compression level must be 0..9, got #{options[:compress].inspect}!"
+               end
+    super(type, in_path, out_path, err_path,
+          options[:buffer_size], options[:preallocate], options[:fsync], compress)
   end
 
-  # Delete the Plotter.
+  # Delete the Plotter, and close the streams it has opened. A Plotter
+  # that is garbage collected without being deleted is deleted by the
+  # collector. The memory of the canvas of an open bitmap Plotter
+  # (_pnm_, _png_ or _gif_), estimated from the +BITMAPSIZE+
+  # parameter, is reported to the garbage collector and included in
+  # <tt>ObjectSpace.memsize_of</tt>.
   #
   # +DeletePlotterError+ exception will be raise if the Plotter could
   # not be delete.
@@ -242,9 +280,22 @@ class Plotter < Rplot
     super
   end
 
+  # Returns +true+ if the Plotter has been deleted.
+  def deleted?
+    super
+  end
+
+  # Returns the memory in bytes held by the Plotter: its output buffer
+  # and, while open, the estimated canvas of a bitmap Plotter. This is
+  # what <tt>ObjectSpace.memsize_of</tt> reports.
+  def memsize
+    super
+  end
+
   # Sets the value of the device driver parameters. The parameter
   # values in effect at the time any Plotter is created are copied
-  # into it.  Unrecognized parameters are ignored.
+  # into it.  Unrecognized parameters are ignored. A +nil+ value
+  # unsets the parameter, so that its default is used.
   #
   # The list of the recognized parameters:
   #
@@ -595,28 +646,148 @@ class Plotter < Rplot
   #                                            X display.
   def self.params(options = {})
     options.each do |k,v|
-      Rplot.param(k.to_s.upcase, v.to_s)
+      Rplot.param(k.to_s.upcase, v.nil? ? nil : v.to_s)
     end
   end
 
   # Create a new plotter that live inside the +block+ passed to
   # +draw+.  Operations in +block+ are wrapped between +open+, +erase+
-  # and +delete+ methods.
-  def self.draw(type, out_path, in_path = nil, err_path = nil)
-    plotter = Plotter.new(type, out_path, in_path, err_path)
-    plotter.open
-    plotter.erase
-    yield(plotter)
-    plotter.delete
+  # and +delete+ methods. The Plotter is deleted even if +block+
+  # raises.
+  def self.draw(type, out_path, in_path = nil, err_path = nil, options = {})
+    plotter = Plotter.new(type, out_path, in_path, err_path, options)
+    begin
+      plotter.open
+      plotter.erase
+      yield(plotter)
+    ensure
+      plotter.delete unless plotter.deleted?
+    end
   end
 
+  # Render the operations in +block+ with a Plotter of +type+ and
+  # return its output, reusing the output of an identical earlier
+  # rendering when the Plotter::Cache +:cache+ still holds it. The
+  # block receives a Plotter::Recording, and a SHA-256 digest of
+  # +type+, the parameters set with Rplot.param, the other options
+  # (passed to Plotter.new) and every operation is computed as the
+  # operations are recorded; libplot only runs when the cache misses. Operation
+  # arguments may be numbers, strings, symbols, arrays, hashes,
+  # Rplot::Path and Rplot::Scene objects.
+  #
+  #    CACHE = Plotter::Cache.new(:max_bytes => 32 << 20)
+  #    png = Plotter.cached_draw('png', :cache => CACHE) do |p|
+  #      p.circle(0.5, 0.5, 0.25)
+  #    end
+  def self.cached_draw(type, options = {})
+    cache = options[:cache]
+    raise ArgumentError, 'A :cache is required!' if cache.nil?
+    options = options.reject { |k, v| k == :cache }
+    recording = Recording.new(Rplot::Digest.new)
+    recording.digest.op(:cached_draw, [type.to_s, Rplot.current_params.sort, options.to_a])
+    yield(recording)
+    cache.fetch(recording.digest.hexdigest) do |path|
+      Plotter.draw(type.to_s, path, nil, nil, options) { |p| recording.replay(p) }
+    end
+  end
+
+  # Render the operations in +block+ as a PNM image of
+  # +:bitmapsize+ pixels (default "570x570") written to +out_path+,
+  # split in a grid of +:tiles+ <tt>[columns, rows]</tt> (default
+  # <tt>[1, 1]</tt>). The block receives a Plotter::Recording; its
+  # operations are replayed into one PNM Plotter per tile, with the
+  # window set by +space+ or +space2+ (default 0,0,1,1) narrowed to
+  # the tile, and the tiles are stitched together one band of rows
+  # at a time, so that only a tile is held in memory. Since libplot
+  # Plotters share process-wide state, tiles are rendered in parallel
+  # by forking up to +:workers+ processes (default 1). Sizes that
+  # depend on the display size, like the default font size, should be
+  # set explicitly. The +BITMAPSIZE+ parameter is restored on return.
+  # Raises ArgumentError unless there is at least one pixel per tile.
+  def self.draw_tiled(out_path, options = {})
+    size = (options[:bitmapsize] || '570x570').to_s
+    width, height = size.split('x').map { |n| n.to_i }
+    if width.nil? || height.nil? || width <= 0 || height <= 0
+      raise ArgumentError, "Bitmap size must be WIDTHxHEIGHT, got #{size.inspect}!"
+    end
+    tiles = options[:tiles] || [1, 1]
+    columns, rows = tiles
+    unless Array === tiles && tiles.size == 2 && Integer === columns && Integer === rows &&
+        (1..width).include?(columns) && (1..height).include?(rows)
+      raise ArgumentError, "Tiles must be [columns, rows] with 1..#{width} columns and 1..#{height} rows, got #{tiles.inspect}!"
+    end
+    workers = options[:workers] || 1
+    recording = Recording.new
+    yield(recording)
+    params = Rplot.current_params
+    xs = (0..columns).map { |i| width * i / columns }
+    ys = (0..rows).map { |j| height * j / rows }
+    running = {}
+    Dir.mktmpdir('rplot') do |dir|
+      tile_path = lambda { |i, j| File.join(dir, "#{j}_#{i}.pnm") }
+      render = lambda do |i, j|
+        Plotter.params(:bitmapsize => "#{xs[i+1] - xs[i]}x#{ys[j+1] - ys[j]}")
+        window = [xs[i].to_f / width, 1 - ys[j+1].to_f / height,
+                  xs[i+1].to_f / width, 1 - ys[j].to_f / height]
+        Plotter.draw('pnm', tile_path[i, j]) { |p| recording.replay_tile(p, window) }
+      end
+      stitch = lambda do |j|
+        tiles = (0...columns).map { |i| tile_path[i, j] }
+        Rplot.stitch_pnm(out_path, tiles)
+        tiles.each { |tile| File.delete(tile) }
+      end
+      File.open(out_path, 'wb') { |f| f.write("P6\n#{width} #{height}\n255\n") }
+      if workers > 1 && Process.respond_to?(:fork)
+        queue = (0...rows).to_a.product((0...columns).to_a)
+        done = Array.new(rows, 0)
+        band = 0
+        while band < rows
+          while running.size < workers && !queue.empty?
+            j, i = queue.shift
+            running[fork { tile_worker { render[i, j] } }] = [i, j]
+          end
+          # Only reap the workers, not other children of the caller
+          pid, status = Process.wait2(running.keys.first)
+          i, j = running.delete(pid)
+          raise OperationPlotterError, "Couldn't render tile #{i},#{j}!" unless status.success?
+          done[j] += 1
+          while band < rows && done[band] == columns
+            stitch[band]
+            band += 1
+          end
+        end
+      else
+        rows.times do |j|
+          columns.times { |i| render[i, j] }
+          stitch[j]
+        end
+      end
+    end
+  ensure
+    running.each_key { |pid| Process.kill(:TERM, pid) rescue nil; Process.wait(pid) rescue nil } if running
+    Rplot.param('BITMAPSIZE', params['BITMAPSIZE']) if params
+  end
+
+  # Runs the block in a forked tile worker and leaves with exit!, so
+  # that the worker skips the at_exit hooks, stdio buffers and
+  # finalizers inherited from the parent, whose Plotters would
+  # otherwise be deleted and their output files closed.
+  def self.tile_worker
+    yield
+    exit!(0)
+  rescue Exception
+    exit!(1)
+  end
+  private_class_method :tile_worker
+
   # Wrap Plotter operations between +open+, +erase+ and +delete+
-  # methods.
+  # methods. The Plotter is deleted even if the block raises.
   def draw
     self.open
     self.erase
     yield
-    self.delete
+  ensure
+    self.delete unless self.deleted?
   end
 
 
@@ -769,8 +940,6 @@ class Plotter < Rplot
   # 0xa0...0xff. The string may be plotted at a nonzero angle, if
   # textangle has been called.
   def alabel(horiz_justify, vert_justify, s)
-    horiz_justify = horiz_justify.getbyte(0) if horiz_justify.class == String
-    vert_justify = vert_justify.getbyte(0) if vert_justify.class == String
     super(horiz_justify, vert_justify, s.to_s)
   end
 
@@ -1417,5 +1586,848 @@ class Plotter < Rplot
     ftranslate(tx, ty)
   end
 
+
+  #-----------------#
+  # Batch functions #
+  #-----------------#
+
+
+  # +heatmap+ draws the 2D +matrix+ of values as a grid of filled
+  # cells in a single call. +matrix+ is either an array of rows or a
+  # string of native doubles packed in row-major order (see
+  # <tt>Array#pack('d*')</tt>); in the latter case the +:columns+
+  # option is required. Each value is quantized into the +:colormap+
+  # option, an array of <tt>[red, green, blue]</tt> colors (in the
+  # same 0...65535 range used by +fillcolor+), linearly between the
+  # +:range+ option <tt>[min, max]</tt> (by default the extent of the
+  # data). NaN values are not drawn. Row 0 is drawn at the bottom of
+  # the +:window+ option <tt>[x0, y0, x1, y1]</tt>, which defaults to
+  # one user unit per cell. Adjacent cells of the same color in a row
+  # are merged into a single box; if +:merge+ is <tt>:rects</tt>
+  # identical runs of consecutive rows are merged too, if it is
+  # <tt>:none</tt> every cell is drawn on its own. The drawing
+  # attributes are restored on return. Returns the number of boxes
+  # drawn.
+  def heatmap(matrix, options = {})
+    if matrix.class == Array
+      columns = matrix.first.size
+      if matrix.any? { |row| row.size != columns }
+        raise ArgumentError, "Matrix rows must all have #{columns} values!"
+      end
+      matrix = matrix.flatten.pack('d*')
+    else
+      columns = options[:columns]
+    end
+    merge = { :none => 0, :rows => 1, :rects => 2 }.fetch(options[:merge] || :rows)
+    super(matrix, columns, options[:colormap], options[:range], options[:window], merge)
+  end
+
+  # +contour+ draws the isolines of the 2D +grid+ of values at each of
+  # the +:levels+ option values (a number or an array), using the
+  # marching squares algorithm. +grid+ is either an array of rows or a
+  # string of native doubles packed in row-major order, in which case
+  # the +:columns+ option is required. The grid points are spread over
+  # the +:window+ option <tt>[x0, y0, x1, y1]</tt>, by default one
+  # user unit apart with row 0 at the bottom. The segments of a level
+  # are stitched into polylines, and each polyline is drawn as a
+  # single path with the current drawing attributes. Cells with a NaN
+  # corner are skipped. If the +:threads+ option is greater than 1,
+  # the levels are traced in parallel on that many native threads
+  # before being drawn. Returns the number of paths drawn.
+  def contour(grid, options = {})
+    if grid.class == Array
+      columns = grid.first.size
+      grid = grid.flatten.pack('d*')
+    else
+      columns = options[:columns]
+    end
+    super(grid, columns, Array(options[:levels]), options[:window], options[:threads] || 1)
+  end
+
+  # +labels+ draws many adjusted labels in a single call: the string
+  # <tt>strings[i]</tt> is drawn at (<tt>xs[i]</tt>, <tt>ys[i]</tt>)
+  # as by +move+ followed by +alabel+. +xs+ and +ys+ are arrays or
+  # strings of packed native doubles. The +:h_justify+ (default "l")
+  # and +:v_justify+ (default "x") options are either a single
+  # justification for all labels, or an array with one per label. The
+  # +:angle+ option is either a single text angle for all labels, set
+  # once, or an array (or packed doubles) with one per label, set only
+  # when it changes between consecutive labels; by default the current
+  # text angle is used. The graphics cursor and text angle are left as
+  # set by the last label. Returns the number of labels drawn.
+  def labels(xs, ys, strings, options = {})
+    xs = xs.pack('d*') if xs.class == Array
+    ys = ys.pack('d*') if ys.class == Array
+    h_justify = Array(options[:h_justify] || 'l').map { |j| j.class == String ? j[0] : j.chr }.join
+    v_justify = Array(options[:v_justify] || 'x').map { |j| j.class == String ? j[0] : j.chr }.join
+    angle = options[:angle].class == Array ? options[:angle].pack('d*') : options[:angle]
+    super(xs, ys, strings.map { |s| s.to_s }, h_justify, v_justify, angle)
+  end
+
+  # +polyline+ draws the vertices (<tt>xs[i]</tt>, <tt>ys[i]</tt>) as a
+  # single open path, with the current drawing attributes. +xs+ and
+  # +ys+ are arrays or strings of packed native doubles. With the
+  # +:from+ option the path starts at that vertex index, so that only
+  # the tail of a growing series is drawn. The path is ended on
+  # return. Returns the number of segments drawn.
+  def polyline(xs, ys, options = {})
+    xs = xs.pack('d*') if xs.class == Array
+    ys = ys.pack('d*') if ys.class == Array
+    super(xs, ys, options[:from] || 0)
+  end
+
+  # +plot_file+ draws the samples of the data file +path+ without
+  # loading it: binary files are mapped in memory (or read in chunks
+  # when they can't be), CSV files are read in chunks of 64 KB, and
+  # each record goes straight to the native drawing loop, so files
+  # larger than memory can be plotted. Options are:
+  # * +:format+ - +:f64le+ (default) or +:f32le+ for records of
+  #   little endian doubles or floats, or +:csv+ for comma separated
+  #   values, where blank lines and lines with text in the columns
+  #   (like headers) are skipped, and empty values read as NaN.
+  # * +:columns+ - the indices <tt>[x, y]</tt> of the x and y columns
+  #   in a record (default <tt>[0, 1]</tt>), or the index of the y
+  #   column alone, the x being the record index. Every record counts
+  #   in the index, those with NaN values too, but not the skipped
+  #   CSV lines.
+  # * +:fields+ - the number of values in a binary record (default
+  #   one more than the greatest column index).
+  # * +:marker+ and +:marker_size+ - draws a marker symbol of this type
+  #   and size (default 1) at each sample, see +marker+, instead of a
+  #   polyline through them.
+  # NaN coordinates break the polyline. Returns the number of samples
+  # drawn.
+  def plot_file(path, options = {})
+    format = [:f64le, :f32le, :csv].index(options[:format] || :f64le)
+    raise ArgumentError, "Unknown file format #{options[:format]}!" if format.nil?
+    columns = options[:columns] || [0, 1]
+    x, y = columns.class == Array ? columns : [-1, columns]
+    fields = options[:fields] || [x, y].max + 1
+    super(path.to_s, format, fields, x, y, options[:marker], options[:marker_size] || 1)
+  end
+
+  # +polygons+ fills many polygons with holes in a single call, e.g.
+  # the regions of a choropleth map, from buffers in a GeoArrow-like
+  # layout: +coords+ holds the vertices of all the rings as x, y
+  # pairs, +ring_offsets+ the index of the first vertex of each ring
+  # followed by the number of vertices, and +polygon_offsets+ the
+  # index of the first ring of each polygon followed by the number of
+  # rings. +coords+ is an array or a string of packed native doubles,
+  # the offsets arrays or strings of packed 32-bit integers
+  # (<tt>pack('l*')</tt>). Each polygon is drawn as one compound path
+  # of closed rings, so holes are left out by the fill rule, the
+  # +:fill_rule+ option ("even-odd" or "nonzero-winding", see
+  # +fillmod+). The +:fill_colors+ option gives the fill color of
+  # each polygon, either as <tt>0xRRGGBB</tt> integers, as
+  # <tt>[red, green, blue]</tt> triples in the 0...65535 range used
+  # by +fillcolor+, or as a string of such triples packed as native
+  # 16-bit integers (<tt>pack('S*')</tt>); the fill color is set only
+  # when it changes. Without it the current fill color is used. Rings
+  # are outlined with the current pen. The drawing attributes are
+  # restored on return. Returns the number of polygons drawn.
+  def polygons(coords, ring_offsets, polygon_offsets, options = {})
+    coords = coords.flatten.pack('d*') if coords.class == Array
+    ring_offsets = ring_offsets.pack('l*') if ring_offsets.class == Array
+    polygon_offsets = polygon_offsets.pack('l*') if polygon_offsets.class == Array
+    colors = options[:fill_colors]
+    if colors.class == Array
+      colors = colors.map do |c|
+        c.class == Array ? c : [(c >> 16 & 255) * 257, (c >> 8 & 255) * 257, (c & 255) * 257]
+      end.flatten.pack('S*')
+    end
+    super(coords, ring_offsets, polygon_offsets, colors, options[:fill_rule])
+  end
+
+  # +path+ draws the Rplot::Path +path+ as a single path, with the
+  # current drawing attributes. The path is ended on return. Returns
+  # the number of segments drawn.
+  def path(path)
+    super(path)
+  end
+
+  # +stamp+ draws an instance of the Rplot::Path +path+ at each
+  # position (<tt>xs[i]</tt>, <tt>ys[i]</tt>), e.g. for glyph plots
+  # like wind barbs or arrows. Each instance is rotated by the
+  # +:angle+ option (in degrees counterclockwise, default 0) and
+  # scaled by the +:scale+ option (default 1) about the path origin,
+  # then moved to its position, as by +savestate+, +translate+,
+  # +rotate+, +scale+, +path+ and +restorestate+. +xs+, +ys+ and the
+  # options may be arrays or strings of packed native doubles, the
+  # options also a single number for all the instances. Returns the
+  # number of instances drawn.
+  def stamp(path, xs, ys, options = {})
+    xs = xs.pack('d*') if xs.class == Array
+    ys = ys.pack('d*') if ys.class == Array
+    angle = options[:angle] || 0
+    scale = options[:scale] || 1
+    angle = angle.pack('d*') if angle.class == Array
+    scale = scale.pack('d*') if scale.class == Array
+    super(path, xs, ys, angle, scale)
+  end
+
+  # +scene+ draws the part of the Rplot::Scene +scene+ visible in the
+  # window with lower left corner (x0, y0) and upper right corner (x1,
+  # y1). The window becomes the Plotter user coordinate system, as
+  # with +space+, and only the items found through the scene spatial
+  # index are drawn, in the order they were added. The drawing
+  # attributes are restored on return. Returns the number of items
+  # drawn.
+  def scene(scene, x0, y0, x1, y1)
+    super(scene, x0, y0, x1, y1)
+  end
+
+  # +axis+ draws an axis going from +min+ to +max+ in a single call:
+  # the axis line, a tick at each "nice" value (1, 2 or 5 times a power
+  # of ten) and their labels, thinned to every k-th label when they
+  # would overlap with the current font. Options are:
+  # * +:orientation+ - +:bottom+ (default), +:top+, +:left+ or
+  #   +:right+, the side of the axis where ticks and labels go.
+  # * +:position+ - the y coordinate of an horizontal axis, or the x
+  #   coordinate of a vertical one (default 0).
+  # * +:scale+ - +:linear+ (default), +:log+ or +:time+. A log axis is
+  #   drawn in log10 user coordinates, with ticks at powers of ten
+  #   (and their 2 and 5 multiples on short ranges); a time axis takes
+  #   seconds since the Epoch and labels the ticks in UTC.
+  # * +:ticks+ - the maximum number of ticks wanted (default 5); the
+  #   nice step giving the most ticks up to it is used.
+  # * +:tick_size+ - the tick length in user units (default 1/50 of
+  #   the axis length).
+  # * +:format+ - a +printf+ format for the labels with a single
+  #   <tt>%e</tt>, <tt>%f</tt> or <tt>%g</tt> conversion (default
+  #   "%g"), or a +strftime+ one for a time axis (default chosen by
+  #   the tick step).
+  # The drawing attributes are restored on return. Returns the array
+  # of tick values.
+  def axis(min, max, options = {})
+    orientation = (options[:orientation] || :bottom).to_s[0].ord
+    scale = [:linear, :log, :time].index(options[:scale] || :linear)
+    raise ArgumentError, "Unknown axis scale #{options[:scale]}!" if scale.nil?
+    super(min, max, orientation, options[:position] || 0, scale, options[:ticks] || 5, options[:tick_size], options[:format])
+  end
+
+end
+
+class Rplot
+
+  # Traces the Rplot calls made in the block and writes them to +path+
+  # in the Chrome trace event format, to be opened with
+  # <tt>chrome://tracing</tt> or Perfetto. Only the calling thread is
+  # traced, so other threads run at full speed (before Ruby 3.2 the
+  # calls of every thread are checked). Every call of a C method of
+  # Rplot, Rplot::Scene or Rplot::Path is recorded as a begin and end
+  # event, together with the time spent in libplot opening and closing
+  # pages, compressed stream writes and output flushes. Events go to a
+  # ring buffer of +:events+ entries (default 65536) allocated up
+  # front; when it fills up the oldest events are dropped, and counted
+  # in the trace. With a +nil+ +path+ nothing is recorded nor written,
+  # but the <tt>rplot:begin</tt> and <tt>rplot:end</tt> USDT probes
+  # still fire for the block, when the extension was built with
+  # <tt>sys/sdt.h</tt>. Returns the value of the block.
+  def self.trace(path, options = {})
+    trace_start(path.nil? ? 0 : options[:events] || 65536)
+    begin
+      yield
+    ensure
+      trace_stop(path && path.to_s)
+    end
+  end
+  private_class_method :trace_start, :trace_stop
+
+  # Warm up libplot ahead of the first chart, typically in the master
+  # of a preforking server so that its children inherit the touched
+  # code and tables copy-on-write. For each Plotter type in the
+  # +:types+ option (default <tt>['meta']</tt>) a Plotter writing to
+  # the null device draws a page with paths, fills, markers and named
+  # colors, and measures and draws a label in each font of the
+  # +:fonts+ option. X Plotters pop up a window, so they should not
+  # be warmed up this way.
+  def self.warmup(options = {})
+    fonts = options[:fonts] || []
+    (options[:types] || ['meta']).each do |type|
+      Plotter.draw(type.to_s, File::NULL) do |p|
+        p.space(0, 0, 100, 100)
+        p.pencolor('black')
+        p.fillcolor('white')
+        p.filltype(1)
+        p.box(10, 10, 90, 90)
+        p.circle(50, 50, 20)
+        p.move(10, 10)
+        p.cont(90, 90)
+        p.endpath
+        p.marker(50, 50, 1, 5)
+        fonts.each do |font|
+          p.fontname(font)
+          p.fontsize(10)
+          p.labelwidth('Warm up 0123456789')
+          p.move(50, 50)
+          p.alabel('c', 'c', 'Warm up 0123456789')
+        end
+      end
+    end
+    nil
+  end
+
+end
+
+# A Scene holds a large set of primitives in native memory together
+# with a uniform grid spatial index, so that it can be drawn at many
+# viewports with Plotter#scene visiting only the visible items. The
+# index is built once, on +build+ or on the first draw, and rebuilt
+# only if items are added afterwards; a built scene can be shared by
+# any number of Plotters and threads.
+class Rplot::Scene
+
+  # Sets the pen and fill colors of subsequently added items, each as
+  # a <tt>[red, green, blue]</tt> array in the 0...65535 range or
+  # +nil+ to use the Plotter ones. Filled items use +filltype+ 1.
+  def color(pen, fill = nil)
+    colors(pen, fill)
+    self
+  end
+
+  # Adds a line segment from (x1, y1) to (x2, y2).
+  def line(x1, y1, x2, y2)
+    add(LINE, [x1, y1, x2, y2])
+  end
+
+  # Adds a box with lower left corner (x1, y1) and upper right corner
+  # (x2, y2).
+  def box(x1, y1, x2, y2)
+    add(BOX, [x1, y1, x2, y2])
+  end
+
+  # Adds a circle with center (xc, yc) and radius +r+.
+  def circle(xc, yc, r)
+    add(CIRCLE, [xc, yc, r])
+  end
+
+  # Adds an ellipse with center (xc, yc), semiaxes +rx+ and +ry+ and
+  # inclination +angle+.
+  def ellipse(xc, yc, rx, ry, angle)
+    add(ELLIPSE, [xc, yc, rx, ry, angle])
+  end
+
+  # Adds a point at (x, y).
+  def point(x, y)
+    add(POINT, [x, y])
+  end
+
+  # Adds a marker symbol of +type+ and +size+ at (x, y), see
+  # Plotter#marker.
+  def marker(x, y, type, size)
+    add(MARKER, [x, y, type, size])
+  end
+
+  # Adds a polyline through the vertices +xy+, either an array of
+  # <tt>[x, y]</tt> pairs or a string of native doubles packed as x,
+  # y pairs.
+  def polyline(xy)
+    xy = xy.flatten.pack('d*') if xy.class == Array
+    add_polyline(xy)
+  end
+
+  # Adds a point, or a marker symbol of +type+ and +size+ if +type+
+  # is given, at each of the vertices +xy+ (as in +polyline+).
+  def markers(xy, type = nil, size = nil)
+    xy = xy.flatten.pack('d*') if xy.class == Array
+    add_markers(xy, type, size)
+  end
+
+  # Builds the spatial index with a grid of +cells+ x +cells+ cells
+  # (by default about four items per cell) over the scene bounds.
+  def build(cells = nil)
+    build_index(cells)
+  end
+
+end
+
+# A Path is a retained sequence of path segments (moves, lines,
+# circular and elliptic arcs, quadratic and cubic Bezier curves) kept
+# in native memory with its bounding box. It is built once and drawn
+# into any Plotter with Plotter#path, without allocating, which suits
+# symbols and outlines drawn in many frames or exports. Segments take
+# the arguments of the Plotter operations of the same name. A Path
+# with several subpaths is drawn as one compound path, so holes and
+# disjoint pieces are filled according to +fillmod+.
+class Rplot::Path
+
+  # Starts a new subpath at (x, y).
+  def move(x, y)
+    add(MOVE, [x, y])
+  end
+
+  # Adds a line segment to (x, y).
+  def cont(x, y)
+    add(CONT, [x, y])
+  end
+
+  # Adds a circular arc from (x0, y0) to (x1, y1) with center (xc,
+  # yc).
+  def arc(xc, yc, x0, y0, x1, y1)
+    add(ARC, [xc, yc, x0, y0, x1, y1])
+  end
+
+  # Adds a quarter ellipse from (x0, y0) to (x1, y1) with center (xc,
+  # yc).
+  def ellarc(xc, yc, x0, y0, x1, y1)
+    add(ELLARC, [xc, yc, x0, y0, x1, y1])
+  end
+
+  # Adds a quadratic Bezier curve from (x0, y0) to (x2, y2) with
+  # control point (x1, y1).
+  def bezier2(x0, y0, x1, y1, x2, y2)
+    add(BEZIER2, [x0, y0, x1, y1, x2, y2])
+  end
+
+  # Adds a cubic Bezier curve from (x0, y0) to (x3, y3) with control
+  # points (x1, y1) and (x2, y2).
+  def bezier3(x0, y0, x1, y1, x2, y2, x3, y3)
+    add(BEZIER3, [x0, y0, x1, y1, x2, y2, x3, y3])
+  end
+
+  # Closes the current subpath.
+  def close
+    add(CLOSE, [])
+  end
+
+end
+
+# A FanOut mirrors every Plotter operation invoked on it to several
+# Plotters, e.g. to produce a PNG preview and a Postscript file from a
+# single drawing session, without recording it first. Each Plotter
+# selects itself on every operation, so the outputs never mix.
+#
+# With the +:threads+ option each Plotter is fed from its own queue by
+# its own thread, and operations return +self+ as soon as they are
+# queued. libplot draws and writes its output holding the Ruby global
+# lock, so the threads take turns with the drawing code rather than
+# running in parallel with it or with each other: the total time is
+# not reduced. Errors are raised by +delete+ or +join+.
+#
+#    Plotter.params(:bitmapsize => '300x300')
+#    fan = Plotter::FanOut.new([Plotter.new('png', 'preview.png'),
+#                               Plotter.new('ps', 'print.ps')])
+#    fan.open
+#    fan.erase
+#    fan.circle(0.5, 0.5, 0.25)
+#    fan.delete
+class Plotter::FanOut
+
+  # The Plotters the operations are forwarded to.
+  attr_reader :plotters
+
+  def initialize(plotters, options = {})
+    @plotters = plotters
+    if options[:threads]
+      @queues = plotters.map { Queue.new }
+      @workers = plotters.zip(@queues).map do |plotter, queue|
+        Thread.new do
+          Thread.current.report_on_exception = false
+          while (op = queue.pop)
+            name, args, block = op
+            plotter.send(name, *args, &block)
+          end
+        end
+      end
+    end
+  end
+
+  # Waits until every queued operation has been applied, when threads
+  # are used, and stops the threads. Once all of them have stopped,
+  # raises the first error of a Plotter, if any.
+  def join
+    return self unless @workers
+    @queues.each { |queue| queue << nil }
+    workers, @workers, @queues = @workers, nil, nil
+    error = nil
+    workers.each do |worker|
+      begin
+        worker.join
+      rescue Exception => e
+        error ||= e
+      end
+    end
+    raise error if error
+    self
+  end
+
+  # Deletes all the Plotters, see Plotter#delete. The Plotters left
+  # by an error are deleted too, before the error is raised.
+  def delete
+    forward(:delete, [])
+    join
+    nil
+  ensure
+    @plotters.reject { |plotter| plotter.deleted? }.each { |plotter| plotter.delete rescue nil }
+  end
+
+  # Opens and erases all the Plotters, runs the block once, with the
+  # FanOut, and deletes them all, even if the block raises.
+  def draw
+    forward(:open, [])
+    forward(:erase, [])
+    yield(self)
+  ensure
+    delete
+  end
+
+  def method_missing(name, *args, &block)
+    if Plotter.public_method_defined?(name)
+      forward(name, args, &block)
+    else
+      super
+    end
+  end
+
+  def respond_to_missing?(name, include_private = false)
+    Plotter.public_method_defined?(name) || super
+  end
+
+  private
+
+  # Returns the result of the first Plotter, or +self+ with threads.
+  # Threads share a frozen copy of the arguments, so that the caller
+  # may reuse its buffers once the operation is queued.
+  def forward(name, args, &block)
+    if @queues
+      args = Plotter::Recording.snapshot(args)
+      @queues.each { |queue| queue << [name, args, block] }
+      self
+    else
+      @plotters.map { |plotter| plotter.send(name, *args, &block) }.first
+    end
+  end
+
 end
 
+# A Recording stores the Plotter operations invoked on it, in order,
+# so that they can be replayed later on one or more Plotters. Any
+# public Plotter drawing, attribute or mapping operation may be
+# recorded; operations return +self+ rather than the Plotter result,
+# so queries like +labelwidth+ are not meaningful while recording.
+# Arguments are copied as they are recorded, so the caller may reuse
+# its strings, arrays, Rplot::Path and Rplot::Scene objects
+# afterwards. Frozen ones are recorded as they are: freeze a large
+# Scene drawn by many recordings, e.g. with Plotter.cached_draw, so
+# that it is neither copied nor digested again.
+class Plotter::Recording
+
+  # Operations that belong to the Plotter life cycle, not to a page
+  LIFECYCLE = [:open, :close, :delete, :draw, :flush]
+
+  # The recorded <tt>[operation, arguments]</tt> pairs.
+  attr_reader :ops
+
+  # The Rplot::Digest fed with each operation as it is recorded, if
+  # any, i.e. with the copies that are replayed.
+  attr_reader :digest
+
+  def initialize(digest = nil)
+    @ops = []
+    @digest = digest
+  end
+
+  # Replay the recorded operations on +plotter+, which must be open.
+  def replay(plotter)
+    @ops.each { |name, args| plotter.send(name, *args) }
+    plotter
+  end
+
+  # Replay the recorded operations on +plotter+ as the tile +window+
+  # <tt>[u0, v0, u1, v1]</tt> of the page, given as fractions of the
+  # recorded window: every +space+ and +space2+ (or +fspace+ and
+  # +fspace2+) is composed with the tile transform, so that changing
+  # the user space while drawing keeps the tile narrowing, and the
+  # view of every +scene+ is narrowed to the tile.
+  def replay_tile(plotter, window)
+    plotter.space2(*Plotter::Recording.tile_window([0, 0, 1, 0, 0, 1], window))
+    @ops.each do |name, args|
+      case name
+      when :space, :fspace
+        x0, y0, x1, y1 = args
+        plotter.space2(*Plotter::Recording.tile_window([x0, y0, x1, y0, x0, y1], window))
+      when :space2, :fspace2
+        plotter.space2(*Plotter::Recording.tile_window(args, window))
+      when :scene
+        # The scene sets its view as the window, narrowed the same way
+        scene, x0, y0, x1, y1 = args
+        tx0, ty0, tx1, ty1, tx2, ty2 = Plotter::Recording.tile_window([x0, y0, x1, y0, x0, y1], window)
+        plotter.scene(scene, tx0, ty0, tx1, ty2)
+      else
+        plotter.send(name, *args)
+      end
+    end
+    plotter
+  end
+
+  # A frozen copy of the operation argument +value+: strings, arrays
+  # and hashes are copied deeply, Rplot::Path and Rplot::Scene objects
+  # by value, along with their spatial index. Frozen strings, paths
+  # and scenes are kept as they are.
+  def self.snapshot(value)
+    case value
+    when String then value.frozen? ? value : value.dup.freeze
+    when Array then value.map { |v| snapshot(v) }.freeze
+    when Hash then Hash[value.map { |k, v| [k, snapshot(v)] }].freeze
+    when Rplot::Path, Rplot::Scene then value.frozen? ? value : value.dup.freeze
+    else value
+    end
+  end
+
+  # The affine window <tt>[x0, y0, x1, y1, x2, y2]</tt> (lower left,
+  # lower right and upper left vertices) of the fraction +window+ of
+  # the affine window +space+.
+  def self.tile_window(space, window)
+    x0, y0, x1, y1, x2, y2 = space.map { |v| v.to_f }
+    u0, v0, u1, v1 = window
+    at = lambda { |u, v| [x0 + u * (x1 - x0) + v * (x2 - x0), y0 + u * (y1 - y0) + v * (y2 - y0)] }
+    at[u0, v0] + at[u1, v0] + at[u0, v1]
+  end
+
+  def method_missing(name, *args)
+    if Plotter.public_method_defined?(name) && !LIFECYCLE.include?(name)
+      args = Plotter::Recording.snapshot(args)
+      @digest.op(name, args) if @digest
+      @ops << [name, args]
+      self
+    else
+      super
+    end
+  end
+
+  def respond_to_missing?(name, include_private = false)
+    (Plotter.public_method_defined?(name) && !LIFECYCLE.include?(name)) || super
+  end
+
+end
+
+# A Series draws a growing sequence of samples on a long-lived
+# Plotter, e.g. a live chart on an X Plotter. Appending samples only
+# draws the new segments, starting from the last vertex drawn, then
+# flushes the Plotter; the whole series is redrawn only when a sample
+# falls right of the window, which then scrolls by a fraction of its
+# width (the +:scroll+ option, default 0.25). Samples are expected in
+# increasing x order, and those scrolled out of the window are
+# dropped. The +:color+ option sets the pen color of the series.
+#
+# The block, if any, is called with the Plotter and the new window
+# after each full redraw, once the page is erased and the window set,
+# to draw axes or other decorations.
+#
+#    series = Plotter::Series.new(plotter, [0, -1, 60, 1], :color => 'red') do |pl, window|
+#      pl.axis(window[0], window[2])
+#    end
+#    series.redraw
+#    loop { series << [Time.now.to_f - start, sample] }
+class Plotter::Series
+
+  # The Plotter the series is drawn on.
+  attr_reader :plotter
+
+  # The current window <tt>[x0, y0, x1, y1]</tt>.
+  attr_reader :window
+
+  def initialize(plotter, window, options = {}, &decorate)
+    @plotter = plotter
+    @window = window.map { |v| v.to_f }
+    @scroll = options[:scroll] || 0.25
+    raise ArgumentError, "Scroll must be a positive fraction of the width, got #{@scroll.inspect}!" unless @scroll.is_a?(Numeric) && @scroll > 0
+    @color = options[:color]
+    @decorate = decorate
+    @xs = ''.force_encoding('BINARY')
+    @ys = ''.force_encoding('BINARY')
+    @drawn = 0
+  end
+
+  # The number of samples kept.
+  def size
+    @xs.bytesize / 8
+  end
+
+  # Appends the samples (<tt>xs[i]</tt>, <tt>ys[i]</tt>), arrays or
+  # strings of packed native doubles, and draws them.
+  def append(xs, ys)
+    xs = xs.pack('d*') if xs.class == Array
+    ys = ys.pack('d*') if ys.class == Array
+    raise ArgumentError, 'Coordinates must have the same length!' if xs.bytesize != ys.bytesize
+    return self if xs.empty?
+    @xs << xs
+    @ys << ys
+    last = xs[-8, 8].unpack('d').first
+    if last > @window[2]
+      scroll(last)
+    else
+      draw(@drawn > 0 ? @drawn - 1 : 0)
+      @plotter.flush
+    end
+    self
+  end
+
+  # Appends the sample <tt>[x, y]</tt>.
+  def <<(sample)
+    append([sample[0]], [sample[1]])
+  end
+
+  # Erases the page, sets the window and draws the whole series.
+  def redraw
+    @plotter.erase
+    @plotter.space(*@window)
+    @decorate.call(@plotter, @window) if @decorate
+    draw(0)
+    @plotter.flush
+    self
+  end
+
+  private
+
+  # Scrolls the window right of +x+ and drops the samples left of it,
+  # but the one the first visible segment starts from.
+  def scroll(x)
+    x0, y0, x1, y1 = @window
+    step = (x1 - x0) * @scroll
+    shift = ((x - x1) / step).ceil * step
+    @window = [x0 + shift, y0, x1 + shift, y1]
+    # Samples are in increasing x order: binary search the packed
+    # history rather than unpacking it
+    first = (0...size).bsearch { |i| @xs.byteslice(i * 8, 8).unpack('d').first >= @window[0] } || size
+    first = [first - 1, 0].max
+    @xs = @xs.byteslice(first * 8, @xs.bytesize)
+    @ys = @ys.byteslice(first * 8, @ys.bytesize)
+    redraw
+  end
+
+  def draw(from)
+    if size - from > 1
+      if @color
+        @plotter.savestate
+        @plotter.pencolor(*Array(@color))
+      end
+      @plotter.polyline(@xs, @ys, :from => from)
+      @plotter.restorestate if @color
+    end
+    @drawn = size
+  end
+
+end
+
+# A Cache keeps rendered outputs by key, for Plotter.cached_draw, up to
+# +:max_bytes+ bytes (default 64 MB), evicting the least recently used
+# outputs first. Outputs are kept in memory, or as files in the
+# directory +:dir+, which then survive the process and can be shared
+# by processes; an existing directory is indexed oldest first by
+# modification time. A Cache may be shared by threads.
+class Plotter::Cache
+
+  # Number of lookups that found the output, and that rendered it.
+  attr_reader :hits, :misses
+
+  # Number of outputs evicted to stay within +:max_bytes+.
+  attr_reader :evictions
+
+  def initialize(options = {})
+    @dir = options[:dir]
+    @max_bytes = options[:max_bytes] || 64 << 20
+    @entries = {}
+    @bytes = @hits = @misses = @evictions = 0
+    @mutex = Mutex.new
+    if @dir
+      FileUtils.mkdir_p(@dir)
+      Dir[File.join(@dir, '*.out')].sort_by { |f| File.mtime(f) }.each do |f|
+        store(File.basename(f, '.out'), File.size(f))
+      end
+    end
+  end
+
+  # The output for +key+. When it is not cached, the block is called
+  # with the path of a temporary file to render the output into.
+  def fetch(key)
+    data = @mutex.synchronize do
+      if @entries.key?(key)
+        # Most recently used entries are last
+        value = @entries[key] = @entries.delete(key)
+        value = read_entry(key) if @dir
+        if value
+          @hits += 1
+          value.dup
+        else
+          # Removed from the directory behind our back
+          @bytes -= @entries.delete(key)
+          nil
+        end
+      end
+    end
+    return data if data
+    @mutex.synchronize { @misses += 1 }
+    tmp = File.join(@dir || Dir.tmpdir, "rplot-#{key}-#{Process.pid}-#{Thread.current.object_id}.tmp")
+    begin
+      yield(tmp)
+      data = File.binread(tmp)
+      @mutex.synchronize do
+        if data.bytesize <= @max_bytes && !@entries.key?(key)
+          File.rename(tmp, entry_path(key)) if @dir
+          store(key, @dir ? data.bytesize : data)
+        end
+      end
+    ensure
+      File.delete(tmp) if File.exist?(tmp)
+    end
+    data
+  end
+
+  # Hit, miss and eviction counts, with the number and total size of
+  # the cached outputs.
+  def stats
+    @mutex.synchronize do
+      { :hits => @hits, :misses => @misses, :evictions => @evictions,
+        :entries => @entries.size, :bytes => @bytes }
+    end
+  end
+
+  # Drops every cached output.
+  def clear
+    @mutex.synchronize do
+      @entries.keys.each { |key| delete_entry(key) } if @dir
+      @entries.clear
+      @bytes = 0
+    end
+    self
+  end
+
+  private
+
+  # Adds an entry, its output or size, and evicts the least recently
+  # used ones beyond the size limit.
+  def store(key, value)
+    @entries[key] = value
+    @bytes += size_of(value)
+    while @bytes > @max_bytes
+      old, value = @entries.first
+      @entries.delete(old)
+      @bytes -= size_of(value)
+      @evictions += 1
+      delete_entry(old) if @dir
+    end
+  end
+
+  def read_entry(key)
+    File.utime(Time.now, Time.now, entry_path(key))
+    File.binread(entry_path(key))
+  rescue SystemCallError
+    nil
+  end
+
+  def delete_entry(key)
+    File.delete(entry_path(key))
+  rescue SystemCallError
+    nil
+  end
+
+  def size_of(value)
+    value.is_a?(String) ? value.bytesize : value
+  end
+
+  def entry_path(key)
+    File.join(@dir, "#{key}.out")
+  end
+
+end
@@ -0,0 +1,40 @@
+require 'test/unit'
+require 'tmpdir'
+require File.expand_path('../../lib/rplot', __FILE__)
+
+class TestAxis < Test::Unit::TestCase
+
+  def axis(min, max, options = {})
+    Dir.mktmpdir do |dir|
+      Plotter.draw('svg', File.join(dir, 'axis.svg')) do |p|
+        p.space(min, min, max, max)
+        return p.axis(min, max, options)
+      end
+    end
+  end
+
+  def test_nice_ticks
+    assert_equal [0, 2, 4, 6, 8, 10], axis(0, 10, :ticks => 6)
+    assert_equal [0.0, 0.2, 0.4, 0.6, 0.8, 1.0], axis(0, 1, :ticks => 6)
+  end
+
+  def test_smaller_step_when_the_first_guess_undershoots
+    assert_equal [0.2, 0.4, 0.6], axis(0.1, 0.7, :ticks => 4)
+    assert_equal [0.5, 1.0, 1.5, 2.0], axis(0.3, 2.1, :ticks => 4)
+  end
+
+  def test_tick_count_is_a_maximum
+    [2, 3, 4, 5, 7, 10, 25].each do |count|
+      [[0, 1], [0.1, 0.7], [-3, 17], [1, 1000]].each do |min, max|
+        ticks = axis(min, max, :ticks => count)
+        assert ticks.size <= count, "#{ticks.size} ticks for #{min}...#{max} and #{count}"
+        assert ticks.size >= 2, "#{ticks.size} ticks for #{min}...#{max} and #{count}" if count > 2
+      end
+    end
+  end
+
+  def test_invalid_format
+    assert_raise(ArgumentError) { axis(0, 1, :format => '%s') }
+  end
+
+end
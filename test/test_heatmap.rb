@@ -0,0 +1,41 @@
+require 'test/unit'
+require 'tmpdir'
+require File.expand_path('../../lib/rplot', __FILE__)
+
+class TestHeatmap < Test::Unit::TestCase
+
+  GRAY = [[0, 0, 0], [65535, 65535, 65535]]
+
+  def heatmap(matrix, options = {})
+    Dir.mktmpdir do |dir|
+      Plotter.draw('svg', File.join(dir, 'heatmap.svg')) do |p|
+        return p.heatmap(matrix, { :colormap => GRAY, :merge => :rows }.merge(options))
+      end
+    end
+  end
+
+  def test_in_range_values_get_their_color
+    assert_equal 2, heatmap([[0.0, 0.9]], :range => [0, 1])
+  end
+
+  def test_above_range_values_get_the_last_color
+    assert_equal 2, heatmap([[0.0, 1e30]], :range => [0, 1])
+    assert_equal 2, heatmap([[0.0, 1.0 / 0]], :range => [0, 1])
+    assert_equal 1, heatmap([[0.9, 1e30]], :range => [0, 1])
+  end
+
+  def test_below_range_values_get_the_first_color
+    assert_equal 1, heatmap([[0.0, -1e30]], :range => [0, 1])
+    assert_equal 1, heatmap([[0.0, -1.0 / 0]], :range => [0, 1])
+  end
+
+  def test_nan_values_are_not_drawn
+    assert_equal 1, heatmap([[0.0, 0.0 / 0]], :range => [0, 1])
+  end
+
+  def test_packed_matrix_requires_its_columns
+    assert_equal 2, heatmap([0.0, 1.0, 0.0, 1.0].pack('d*'), :columns => 2, :merge => :rects)
+    assert_raise(ArgumentError) { heatmap([0.0, 1.0, 0.0].pack('d*'), :columns => 2) }
+  end
+
+end
@@ -0,0 +1,38 @@
+require 'test/unit'
+require 'tmpdir'
+require File.expand_path('../../lib/rplot', __FILE__)
+
+class TestPlotFile < Test::Unit::TestCase
+
+  def plot_file(data, options = {})
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'data')
+      File.open(path, 'wb') { |f| f.write(data) }
+      Plotter.draw('svg', File.join(dir, 'plot.svg')) do |p|
+        return p.plot_file(path, options)
+      end
+    end
+  end
+
+  def test_binary_records
+    assert_equal 3, plot_file([0, 1, 1, 2, 2, 0].pack('E*'))
+    assert_equal 2, plot_file([0, 1, 1, 0.0 / 0, 2, 0].pack('E*'))
+    assert_equal 3, plot_file([1, 2, 0].pack('e*'), :format => :f32le, :columns => 0)
+  end
+
+  def test_csv_records
+    csv = "x,y\n0,1\n1,\n\n2,nan\n3,4\n"
+    assert_equal 2, plot_file(csv, :format => :csv)
+    assert_equal 2, plot_file(csv, :format => :csv, :columns => 1)
+  end
+
+  def test_columns_are_checked
+    [:f64le, :csv].each do |format|
+      assert_raise(ArgumentError) { plot_file('', :format => format, :columns => -1) }
+      assert_raise(ArgumentError) { plot_file('', :format => format, :columns => [-2, 0]) }
+      assert_raise(ArgumentError) { plot_file('', :format => format, :columns => [0, -1]) }
+    end
+    assert_raise(ArgumentError) { plot_file('', :columns => [0, 2], :fields => 2) }
+  end
+
+end
@@ -0,0 +1,26 @@
+require 'test/unit'
+require 'tmpdir'
+require File.expand_path('../../lib/rplot', __FILE__)
+
+class TestPlotter < Test::Unit::TestCase
+
+  def test_output_options_need_an_output_path
+    [{ :compress => true }, { :compress => 6 }, { :buffer_size => 1 << 16 }, { :preallocate => 4096 }].each do |options|
+      assert_raise(ArgumentError) { Plotter.new('svg', nil, options) }
+    end
+  end
+
+  def test_output_options_with_an_output_path
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'out.svg')
+      plotter = Plotter.new('svg', path, :buffer_size => 1 << 16, :preallocate => 4096)
+      plotter.delete
+      assert plotter.deleted?
+    end
+  end
+
+  def test_compression_level_is_checked
+    assert_raise(ArgumentError) { Plotter.new('svg', nil, :compress => 10) }
+  end
+
+end